@@ -0,0 +1,109 @@
+#ifndef VK_LAYER_HDR_WSI_H_
+#define VK_LAYER_HDR_WSI_H_ 1
+
+/*
+ * Layer-private structures understood by VK_LAYER_hdr_wsi.
+ *
+ * These are not part of any registered Vulkan extension. The layer reports
+ * the VK_HDRWSI_* names below from vkEnumerateDeviceExtensionProperties, so
+ * applications can check whether a structure will be honored before relying
+ * on it. Enabling them is optional, the layer removes them before the driver
+ * sees the device create info.
+ *
+ * The sType values come from the block Vulkan reserves for extension number
+ * 1000, which is 1000000000 + (1000 - 1) * 1000. Registered extensions are
+ * numbered sequentially and are still far from 1000, so these will not clash
+ * with a real structure soon. Drivers and other layers skip structures with
+ * an sType they do not know, but only chain them while the matching extension
+ * is reported, in case that block is ever handed out.
+ */
+
+#include <vulkan/vulkan.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VK_HDRWSI_PRESENT_COLOR_SPACE_SPEC_VERSION 1
+#define VK_HDRWSI_PRESENT_COLOR_SPACE_EXTENSION_NAME "VK_HDRWSI_present_color_space"
+#define VK_HDRWSI_SWAPCHAIN_COLOR_REPRESENTATION_SPEC_VERSION 1
+#define VK_HDRWSI_SWAPCHAIN_COLOR_REPRESENTATION_EXTENSION_NAME "VK_HDRWSI_swapchain_color_representation"
+#define VK_HDRWSI_SWAPCHAIN_SDR_OVERLAY_SPEC_VERSION 1
+#define VK_HDRWSI_SWAPCHAIN_SDR_OVERLAY_EXTENSION_NAME "VK_HDRWSI_swapchain_sdr_overlay"
+
+#define VK_STRUCTURE_TYPE_PRESENT_COLOR_SPACE_INFO_HDRWSI ((VkStructureType)1000999000)
+#define VK_STRUCTURE_TYPE_SWAPCHAIN_COLOR_SPACES_CREATE_INFO_HDRWSI ((VkStructureType)1000999001)
+#define VK_STRUCTURE_TYPE_SWAPCHAIN_COLOR_REPRESENTATION_CREATE_INFO_HDRWSI ((VkStructureType)1000999002)
+#define VK_STRUCTURE_TYPE_SWAPCHAIN_SDR_OVERLAY_CREATE_INFO_HDRWSI ((VkStructureType)1000999003)
+
+/*
+ * VK_HDRWSI_present_color_space
+ *
+ * Chained to VkPresentInfoKHR. Retags each swapchain with a different color
+ * space starting with this present, without recreating the swapchain.
+ * pColorSpaces has swapchainCount entries, matching VkPresentInfoKHR.
+ */
+typedef struct VkPresentColorSpaceInfoHDRWSI {
+    VkStructureType sType;
+    const void *pNext;
+    uint32_t swapchainCount;
+    const VkColorSpaceKHR *pColorSpaces;
+} VkPresentColorSpaceInfoHDRWSI;
+
+/*
+ * VK_HDRWSI_present_color_space
+ *
+ * Chained to VkSwapchainCreateInfoKHR. Lists the color spaces the application
+ * intends to switch between, so the layer can prepare their image
+ * descriptions up front instead of on the first present that uses them.
+ */
+typedef struct VkSwapchainColorSpacesCreateInfoHDRWSI {
+    VkStructureType sType;
+    const void *pNext;
+    uint32_t colorSpaceCount;
+    const VkColorSpaceKHR *pColorSpaces;
+} VkSwapchainColorSpacesCreateInfoHDRWSI;
+
+/*
+ * VK_HDRWSI_swapchain_color_representation
+ *
+ * Chained to VkSwapchainCreateInfoKHR for multi-planar YCbCr swapchains.
+ * Describes how the compositor has to convert the images to RGB. Without it,
+ * BT.2020 coefficients, narrow range and H.273 chroma location type 0 are used.
+ *
+ * The name is not reported yet: no driver's Wayland WSI offers a multi-planar
+ * surface format, so there is no swapchain to chain this to.
+ */
+typedef struct VkSwapchainColorRepresentationCreateInfoHDRWSI {
+    VkStructureType sType;
+    const void *pNext;
+    VkSamplerYcbcrModelConversion ycbcrModel;
+    VkSamplerYcbcrRange ycbcrRange;
+    VkChromaLocation xChromaOffset;
+    VkChromaLocation yChromaOffset;
+} VkSwapchainColorRepresentationCreateInfoHDRWSI;
+
+/*
+ * VK_HDRWSI_swapchain_sdr_overlay
+ *
+ * Chained to VkSwapchainCreateInfoKHR. Instead of presenting to surface
+ * directly, the swapchain presents to a new Wayland subsurface stacked above
+ * it at its top left corner. The compositor blends it over whatever the parent
+ * surface shows, so SDR UI can be updated independently of an HDR scene.
+ *
+ * The overlay is tagged as sRGB with (1, 1, 1) at referenceWhiteNits, or at the
+ * compositor's default reference white if it is 0. It takes no input, which
+ * keeps going to the parent surface. Recreating it with oldSwapchain keeps the
+ * same subsurface.
+ */
+typedef struct VkSwapchainSdrOverlayCreateInfoHDRWSI {
+    VkStructureType sType;
+    const void *pNext;
+    float referenceWhiteNits;
+} VkSwapchainSdrOverlayCreateInfoHDRWSI;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
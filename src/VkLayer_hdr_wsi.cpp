@@ -1,16 +1,35 @@
 #define VK_USE_PLATFORM_WAYLAND_KHR
 #include "vkroots.h"
+#include "VkLayer_hdr_wsi.h"
 #include "frog-color-management-v1-client-protocol.h"
 #include "xx-color-management-v4-client-protocol.h"
 #include "color-management-v1-client-protocol.h"
+#include "color-representation-v1-client-protocol.h"
 
 #include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
 #include <vector>
 #include <algorithm>
 #include <unordered_map>
 #include <optional>
+#include <tuple>
+#include <string_view>
 #include <ranges>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cinttypes>
+#include <cstdlib>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 using namespace std::literals;
 
@@ -26,6 +45,8 @@ struct ColorDescription {
     wp_color_manager_v1_primaries primaries;
     wp_color_manager_v1_transfer_function transferFunction;
     bool extended_volume;
+    // multi-planar YCbCr, needs wp_color_representation_manager_v1
+    bool ycbcr = false;
 };
 
 static std::vector<ColorDescription> s_ExtraHDRSurfaceFormats = {
@@ -91,6 +112,22 @@ static std::vector<ColorDescription> s_ExtraHDRSurfaceFormats = {
         .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR,
         .extended_volume = true,
     },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16,
+                VK_COLOR_SPACE_HDR10_ST2084_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC2020,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_ST2084_PQ,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_BT2020,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_ST2084_PQ,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_BT2020,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_ST2084_PQ,
+        .extended_volume = false,
+        .ycbcr = true,
+    },
     // ColorDescription{
     //     .surface = {
     //         .surfaceFormat = {
@@ -137,58 +174,380 @@ static std::vector<ColorDescription> s_ExtraHDRSurfaceFormats = {
     // },
 };
 
+// The parameters of the surface's preferred image description, as sent by
+// wp_image_description_info_v1. Luminances and primaries use protocol units.
+struct PreferredDescription {
+    uint32_t identity = 0;
+    uint32_t primaries = 0;
+    uint32_t transferFunction = 0;
+    std::optional<std::array<int32_t, 8>> targetPrimaries;
+    uint32_t targetMinLuminance = 0;
+    uint32_t targetMaxLuminance = 0;
+    uint32_t targetMaxCll = 0;
+    uint32_t targetMaxFall = 0;
+};
+
+// Protocol enums are small, so the values a compositor advertises fit in one
+// word and the listeners can record them without allocating.
+template <typename T>
+struct EnumSet {
+    uint64_t bits = 0;
+
+    void insert(T value)
+    {
+        if (uint32_t(value) < 64) {
+            bits |= uint64_t(1) << uint32_t(value);
+        }
+    }
+
+    bool contains(T value) const
+    {
+        return uint32_t(value) < 64 && (bits >> uint32_t(value)) & 1;
+    }
+};
+
 struct HdrSurfaceData {
     VkInstance instance;
     bool supportsPassthrough = false;
 
+    // reused by every format query so apps polling them only allocate once
+    std::vector<VkSurfaceFormatKHR> driverFormats;
+    std::vector<VkSurfaceFormatKHR> extraFormats;
+    std::vector<VkSurfaceFormat2KHR> extraFormats2;
+
     wl_display *display;
     wl_event_queue *queue;
     frog_color_management_factory_v1 *frogColorManagement;
     xx_color_manager_v4 *xxColorManager;
     wp_color_manager_v1 *colorManager;
 
-    std::vector<xx_color_manager_v4_feature> xxSupportedFeatures;
-    std::vector<xx_color_manager_v4_primaries> xxSupportedPrimaries;
-    std::vector<xx_color_manager_v4_transfer_function> xxSupportedTransferFunctions;
+    EnumSet<xx_color_manager_v4_feature> xxSupportedFeatures;
+    EnumSet<xx_color_manager_v4_primaries> xxSupportedPrimaries;
+    EnumSet<xx_color_manager_v4_transfer_function> xxSupportedTransferFunctions;
+
+    EnumSet<wp_color_manager_v1_feature> supportedFeatures;
+    EnumSet<wp_color_manager_v1_primaries> supportedPrimaries;
+    EnumSet<wp_color_manager_v1_transfer_function> supportedTransferFunctions;
+
+    wp_color_representation_manager_v1 *colorRepresentationManager = nullptr;
+    // only exists while a YCbCr swapchain is presenting to the surface
+    wp_color_representation_surface_v1 *colorRepresentationSurface = nullptr;
+    // indexed by wp_color_representation_surface_v1_range
+    std::array<EnumSet<wp_color_representation_surface_v1_coefficients>, 3> supportedCoefficients;
 
-    std::vector<wp_color_manager_v1_feature> supportedFeatures;
-    std::vector<wp_color_manager_v1_primaries> supportedPrimaries;
-    std::vector<wp_color_manager_v1_transfer_function> supportedTransferFunctions;
+    // for SDR overlay subsurfaces
+    wl_compositor *compositor = nullptr;
+    wl_subcompositor *subcompositor = nullptr;
 
     wl_surface *surface;
     frog_color_managed_surface *frogColorSurface;
     xx_color_management_surface_v4 *xxColorSurface;
     wp_color_management_surface_v1 *colorSurface;
+
+    // only with HDR_WSI_MATCH_PREFERRED=1 and wp_color_manager_v1
+    wp_color_management_surface_feedback_v1 *feedback = nullptr;
+    PreferredDescription preferred;
+    uint64_t preferredSerial = 0;
+    bool preferredChanged = false;
+
+    // Wayland surfaces are only probed once the app queries formats, and only
+    // get a color surface with their first non-sRGB swapchain
+    bool probed = false;
+    bool activated = false;
+    // the compositor can't tag this surface, the layer stays out of the way
+    bool inactive = false;
+
+    // VK_EXT_headless_surface: nothing to tag, every present is reported to the sink instead
+    bool headless = false;
+    int sinkFd = -1;
+    bool sinkIsSocket = false;
+    // the part of a line the socket didn't take yet, sent before anything new
+    std::array<char, 1024> sinkPending;
+    size_t sinkPendingOffset = 0;
+    size_t sinkPendingLength = 0;
+    uint64_t sinkDropped = 0;
 };
 VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrSurface, VkSurfaceKHR);
 
-struct HdrSwapchainData {
-    VkSurfaceKHR surface;
-    frog_color_managed_surface_primaries frogPrimaries;
-    frog_color_managed_surface_transfer_function tf;
+// An image description created for one entry of s_ExtraHDRSurfaceFormats,
+// valid for as long as the swapchain metadata doesn't change.
+struct PreparedDescription {
+    wp_image_description_v1 *description = nullptr;
+    xx_image_description_v4 *xxDescription = nullptr;
+    uint64_t metadataSerial = 0;
+    uint64_t preferredSerial = 0;
+    bool matchesPreferred = false;
+    bool done = false;
+    // the metadata the description was created with, 0 where nothing was sent
+    VkHdrMetadataEXT sentMetadata = {};
+};
 
-    xx_color_manager_v4_primaries xxPrimaries;
-    xx_color_manager_v4_transfer_function xxTransferFunction;
-    bool xxUntagged = false;
+struct ColorRepresentation {
+    wp_color_representation_surface_v1_coefficients coefficients;
+    wp_color_representation_surface_v1_range range;
+    wp_color_representation_surface_v1_chroma_location chromaLocation;
+};
 
-    wp_color_manager_v1_primaries primaries;
-    wp_color_manager_v1_transfer_function transferFunction;
-    bool untagged = false;
+struct CaptureRing;
+
+struct HdrSwapchainData {
+    VkSurfaceKHR surface;
+    VkFormat format;
+    VkColorSpaceKHR colorSpace;
+    // nullptr means untagged
+    const ColorDescription *description = nullptr;
+    // only for YCbCr formats
+    std::optional<ColorRepresentation> representation;
 
     VkHdrMetadataEXT metadata;
+    uint64_t metadataSerial = 0;
+
+    // indexed like s_ExtraHDRSurfaceFormats
+    std::vector<PreparedDescription> prepared;
+    uint32_t prepareMask = 0;
     bool desc_dirty;
+
+    uint64_t presentCount = 0;
+
+    // what the last tag told the compositor, which captures record: nullptr
+    // if the surface is untagged, and 0 for metadata that wasn't sent
+    const ColorDescription *sentDescription = nullptr;
+    VkHdrMetadataEXT sentMetadata = {};
+
+    // how often the tag matched the surface's preferred image description
+    uint64_t preferredSerial = 0;
+    uint64_t preferredMatches = 0;
+    uint64_t preferredMismatches = 0;
+    bool matchedPreferred = false;
+
+    // only set if HDR_WSI_CAPTURE_DIR is
+    std::shared_ptr<CaptureRing> capture;
 };
 VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrSwapchain, VkSwapchainKHR);
 
+// The subsurface of an HDR surface that SDR overlay swapchains present to,
+// see VkSwapchainSdrOverlayCreateInfoHDRWSI
+struct OverlaySurface {
+    VkInstance instance;
+    VkSurfaceKHR vkSurface;
+    wl_surface *surface;
+    wl_subsurface *subsurface;
+    wp_color_management_surface_v1 *colorSurface = nullptr;
+    xx_color_management_surface_v4 *xxColorSurface = nullptr;
+};
+
+struct HdrOverlayData {
+    // shared with the swapchains recreated from this one, the last one destroys it
+    std::shared_ptr<OverlaySurface> overlay;
+    // set once a swapchain recreated from this one took the subsurface over
+    bool retired = false;
+};
+VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrOverlay, VkSwapchainKHR);
+
+// The instance extensions the app enabled, which decide what the layer can honor
+struct HdrInstanceData {
+    bool swapchainColorspace = false;
+    bool waylandSurface = false;
+    bool headlessSurface = false;
+};
+VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrInstance, VkInstance);
+
+struct HdrQueueData {
+    uint32_t familyIndex;
+};
+VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrQueue, VkQueue);
+
+// Queues handed out per device, so their HdrQueue entries go away with it
+// before a later device gets the same handles.
+struct HdrDeviceData {
+    std::vector<VkQueue> queues;
+};
+VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrDevice, VkDevice);
+
+static bool MatchPreferredEnabled()
+{
+    static const bool s_enabled = [] {
+        const char *env = getenv("HDR_WSI_MATCH_PREFERRED");
+        return env && env == "1"sv;
+    }();
+    return s_enabled;
+}
+
+static constexpr wp_color_management_surface_feedback_v1_listener s_feedbackListener {
+    .preferred_changed = [](void *data, wp_color_management_surface_feedback_v1 *feedback, uint32_t identity) {
+        auto surface = reinterpret_cast<HdrSurfaceData *>(data);
+        surface->preferredChanged = identity != surface->preferred.identity;
+    },
+};
+
+struct PreferredQuery {
+    PreferredDescription preferred;
+    bool ready = false;
+    bool failed = false;
+    bool infoDone = false;
+};
+
+static constexpr wp_image_description_v1_listener s_preferredDescriptionListener {
+    .failed = [](void *data, wp_image_description_v1 *descr, uint32_t cause, const char *reason) {
+        fprintf(stderr, "[HDR Layer] getting the preferred image description failed! %s\n", reason);
+        reinterpret_cast<PreferredQuery *>(data)->failed = true;
+    },
+    .ready = [](void *data, wp_image_description_v1 *descr, uint32_t identity) {
+        auto query = reinterpret_cast<PreferredQuery *>(data);
+        query->preferred.identity = identity;
+        query->ready = true;
+    },
+};
+
+static constexpr wp_image_description_info_v1_listener s_preferredInfoListener {
+    .done = [](void *data, wp_image_description_info_v1 *info) {
+        reinterpret_cast<PreferredQuery *>(data)->infoDone = true;
+        wp_image_description_info_v1_destroy(info);
+    },
+    .icc_file = [](void *data, wp_image_description_info_v1 *info, int32_t icc, uint32_t icc_size) {
+        close(icc);
+    },
+    .primaries = [](void *data, wp_image_description_info_v1 *info, int32_t r_x, int32_t r_y, int32_t g_x, int32_t g_y, int32_t b_x, int32_t b_y, int32_t w_x, int32_t w_y) {
+    },
+    .primaries_named = [](void *data, wp_image_description_info_v1 *info, uint32_t primaries) {
+        reinterpret_cast<PreferredQuery *>(data)->preferred.primaries = primaries;
+    },
+    .tf_power = [](void *data, wp_image_description_info_v1 *info, uint32_t eexp) {
+    },
+    .tf_named = [](void *data, wp_image_description_info_v1 *info, uint32_t tf) {
+        reinterpret_cast<PreferredQuery *>(data)->preferred.transferFunction = tf;
+    },
+    .luminances = [](void *data, wp_image_description_info_v1 *info, uint32_t min_lum, uint32_t max_lum, uint32_t reference_lum) {
+    },
+    .target_primaries = [](void *data, wp_image_description_info_v1 *info, int32_t r_x, int32_t r_y, int32_t g_x, int32_t g_y, int32_t b_x, int32_t b_y, int32_t w_x, int32_t w_y) {
+        reinterpret_cast<PreferredQuery *>(data)->preferred.targetPrimaries = std::array<int32_t, 8>{r_x, r_y, g_x, g_y, b_x, b_y, w_x, w_y};
+    },
+    .target_luminance = [](void *data, wp_image_description_info_v1 *info, uint32_t min_lum, uint32_t max_lum) {
+        auto query = reinterpret_cast<PreferredQuery *>(data);
+        query->preferred.targetMinLuminance = min_lum;
+        query->preferred.targetMaxLuminance = max_lum;
+    },
+    .target_max_cll = [](void *data, wp_image_description_info_v1 *info, uint32_t max_cll) {
+        reinterpret_cast<PreferredQuery *>(data)->preferred.targetMaxCll = max_cll;
+    },
+    .target_max_fall = [](void *data, wp_image_description_info_v1 *info, uint32_t max_fall) {
+        reinterpret_cast<PreferredQuery *>(data)->preferred.targetMaxFall = max_fall;
+    },
+};
+
+// Fetches the parameters of the surface's preferred image description. Only
+// done when the surface is created and when the compositor says it changed.
+static void UpdatePreferredDescription(HdrSurfaceData &surface)
+{
+    PreferredQuery query;
+    const auto description = wp_color_management_surface_feedback_v1_get_preferred_parametric(surface.feedback);
+    wp_image_description_v1_add_listener(description, &s_preferredDescriptionListener, &query);
+    while (!query.ready && !query.failed) {
+        wl_display_roundtrip_queue(surface.display, surface.queue);
+    }
+    if (query.ready) {
+        const auto info = wp_image_description_v1_get_information(description);
+        wp_image_description_info_v1_add_listener(info, &s_preferredInfoListener, &query);
+        while (!query.infoDone) {
+            wl_display_roundtrip_queue(surface.display, surface.queue);
+        }
+    }
+    wp_image_description_v1_destroy(description);
+
+    surface.preferred = query.preferred;
+    surface.preferredSerial++;
+    surface.preferredChanged = false;
+    fprintf(stderr, "[HDR Layer] Preferred image description: primaries %u, transfer function %u, target luminance %u-%u\n",
+            surface.preferred.primaries, surface.preferred.transferFunction,
+            surface.preferred.targetMinLuminance, surface.preferred.targetMaxLuminance);
+}
+
 enum DescStatus {
     WAITING,
     READY,
     FAILED,
 };
 
+// Mesa's headless WSI only reports 8-bit formats, but allocates its images with
+// whatever format the swapchain asks for. Headless surfaces therefore offer
+// the HDR formats the device can render to.
+static bool HeadlessSupportsFormat(const vkroots::VkInstanceDispatch *pDispatch, VkPhysicalDevice physicalDevice, const ColorDescription &description)
+{
+    if (description.ycbcr) {
+        return false;
+    }
+    VkFormatProperties properties = {};
+    pDispatch->GetPhysicalDeviceFormatProperties(physicalDevice, description.surface.surfaceFormat.format, &properties);
+    return properties.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT;
+}
+
+// frog takes precedence, then color-management-v1, then xx-color-management-v4
+static bool UsesColorManagement(const HdrSurfaceData &surface)
+{
+    return !surface.frogColorManagement && surface.colorManager;
+}
+
+static bool UsesXxColorManagement(const HdrSurfaceData &surface)
+{
+    return !surface.frogColorManagement && !surface.colorManager && surface.xxColorManager;
+}
+
+// Whether the compositor advertised everything needed to tag with description.
+// Sending a primaries or transfer function it didn't advertise is a protocol
+// error, which takes the app's whole connection down.
+static bool SurfaceSupportsDescription(const HdrSurfaceData &surface, const ColorDescription &description)
+{
+    if (description.ycbcr && !surface.colorRepresentationManager) {
+        return false;
+    }
+    if (UsesXxColorManagement(surface)) {
+        return surface.xxSupportedPrimaries.contains(description.xxPrimaries)
+            && surface.xxSupportedTransferFunctions.contains(description.xxTransferFunction);
+    }
+    if (UsesColorManagement(surface)) {
+        return surface.supportedPrimaries.contains(description.primaries)
+            && surface.supportedTransferFunctions.contains(description.transferFunction)
+            && (!description.extended_volume || surface.supportedFeatures.contains(WP_COLOR_MANAGER_V1_FEATURE_EXTENDED_TARGET_VOLUME));
+    }
+    return true;
+}
+
+class VkDeviceOverrides;
+
 class VkInstanceOverrides
 {
 public:
+    static VkResult CreateInstance(
+        PFN_vkCreateInstance pfnCreateInstanceProc,
+        const VkInstanceCreateInfo *pCreateInfo,
+        const VkAllocationCallbacks *pAllocator,
+        VkInstance *pInstance)
+    {
+        VkResult result = pfnCreateInstanceProc(pCreateInfo, pAllocator, pInstance);
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+
+        HdrInstanceData instanceData;
+        for (uint32_t i = 0; i < pCreateInfo->enabledExtensionCount; i++) {
+            const std::string_view name = pCreateInfo->ppEnabledExtensionNames[i];
+            instanceData.swapchainColorspace |= name == VK_EXT_SWAPCHAIN_COLOR_SPACE_EXTENSION_NAME;
+            instanceData.waylandSurface |= name == VK_KHR_WAYLAND_SURFACE_EXTENSION_NAME;
+            instanceData.headlessSurface |= name == VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME;
+        }
+        HdrInstance::create(*pInstance, std::move(instanceData));
+        return result;
+    }
+
+    static void DestroyInstance(
+        const vkroots::VkInstanceDispatch *pDispatch,
+        VkInstance instance,
+        const VkAllocationCallbacks *pAllocator)
+    {
+        HdrInstance::remove(instance);
+        pDispatch->DestroyInstance(instance, pAllocator);
+    }
+
     static VkResult CreateWaylandSurfaceKHR(
         const vkroots::VkInstanceDispatch *pDispatch,
         VkInstance instance,
@@ -196,20 +555,18 @@ public:
         const VkAllocationCallbacks *pAllocator,
         VkSurfaceKHR *pSurface)
     {
-        auto queue = wl_display_create_queue(pCreateInfo->display);
-        wl_registry *registry = wl_display_get_registry(pCreateInfo->display);
-        wl_proxy_set_queue(reinterpret_cast<wl_proxy *>(registry), queue);
-
         VkResult res = pDispatch->CreateWaylandSurfaceKHR(instance, pCreateInfo, pAllocator, pSurface);
         if (res != VK_SUCCESS) {
             return res;
         }
 
-        auto hdrSurface = HdrSurface::create(*pSurface, HdrSurfaceData{
+        // Most surfaces never see an HDR swapchain, so don't talk to the
+        // compositor until one asks for it, see ProbeSurface.
+        HdrSurface::create(*pSurface, HdrSurfaceData{
             .instance = instance,
             .supportsPassthrough = false,
             .display = pCreateInfo->display,
-            .queue = queue,
+            .queue = nullptr,
             .frogColorManagement = nullptr,
             .xxColorManager = nullptr,
             .colorManager = nullptr,
@@ -218,45 +575,40 @@ public:
             .xxColorSurface = nullptr,
             .colorSurface = nullptr,
         });
+        return VK_SUCCESS;
+    }
 
-        wl_registry_add_listener(registry, &s_registryListener, reinterpret_cast<void *>(hdrSurface.get()));
-        wl_display_dispatch_queue(pCreateInfo->display, queue);
-        wl_display_roundtrip_queue(pCreateInfo->display, queue); // get globals
-        wl_display_roundtrip_queue(pCreateInfo->display, queue); // get features/supported_cicps/etc
-        wl_registry_destroy(registry);
-
-        if (!hdrSurface->frogColorManagement && !hdrSurface->xxColorManager && !hdrSurface->colorManager) {
-            fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for color management protocols..\n");
-
-            HdrSurface::remove(*pSurface);
-            return VK_SUCCESS;
+    static VkResult CreateHeadlessSurfaceEXT(
+        const vkroots::VkInstanceDispatch *pDispatch,
+        VkInstance instance,
+        const VkHeadlessSurfaceCreateInfoEXT *pCreateInfo,
+        const VkAllocationCallbacks *pAllocator,
+        VkSurfaceKHR *pSurface)
+    {
+        VkResult res = pDispatch->CreateHeadlessSurfaceEXT(instance, pCreateInfo, pAllocator, pSurface);
+        if (res != VK_SUCCESS) {
+            return res;
         }
 
-        if (hdrSurface->frogColorManagement) {
-            frog_color_managed_surface *frogColorSurface = frog_color_management_factory_v1_get_color_managed_surface(hdrSurface->frogColorManagement, pCreateInfo->surface);
-            frog_color_managed_surface_add_listener(frogColorSurface, &color_surface_interface_listener, nullptr);
-            wl_display_flush(hdrSurface->display);
-
-            hdrSurface->frogColorSurface = frogColorSurface;
-        } else if (hdrSurface->colorManager) {
-            const bool hasParametric = std::ranges::find(hdrSurface->supportedFeatures, XX_COLOR_MANAGER_V4_FEATURE_PARAMETRIC) != hdrSurface->supportedFeatures.end();
-            if (!hasParametric) {
-                fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for parametric image descriptions\n");
-                HdrSurface::remove(*pSurface);
-                return VK_SUCCESS;
-            }
-            hdrSurface->colorSurface = wp_color_manager_v1_get_surface(hdrSurface->colorManager, pCreateInfo->surface);
-        } else {
-            const bool hasParametric = std::ranges::find(hdrSurface->xxSupportedFeatures, XX_COLOR_MANAGER_V4_FEATURE_PARAMETRIC) != hdrSurface->xxSupportedFeatures.end();
-            if (!hasParametric) {
-                fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for parametric image descriptions\n");
-                HdrSurface::remove(*pSurface);
-                return VK_SUCCESS;
-            }
-            hdrSurface->xxColorSurface = xx_color_manager_v4_get_surface(hdrSurface->xxColorManager, pCreateInfo->surface);
-        }
+        auto hdrSurface = HdrSurface::create(*pSurface, HdrSurfaceData{
+            .instance = instance,
+            .supportsPassthrough = false,
+            .display = nullptr,
+            .queue = nullptr,
+            .frogColorManagement = nullptr,
+            .xxColorManager = nullptr,
+            .colorManager = nullptr,
+            .surface = nullptr,
+            .frogColorSurface = nullptr,
+            .xxColorSurface = nullptr,
+            .colorSurface = nullptr,
+            .probed = true,
+            .activated = true,
+            .headless = true,
+        });
+        OpenHeadlessSink(*hdrSurface.get());
 
-        fprintf(stderr, "[HDR Layer] Created HDR surface\n");
+        fprintf(stderr, "[HDR Layer] Created headless HDR surface\n");
         return VK_SUCCESS;
     }
 
@@ -267,6 +619,8 @@ public:
         uint32_t *pSurfaceFormatCount,
         VkSurfaceFormatKHR *pSurfaceFormats)
     {
+        if (!InstanceUsesColorSpaces(pDispatch->Instance) || !ProbeSurface(surface))
+            return pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, pSurfaceFormatCount, pSurfaceFormats);
         auto hdrSurface = HdrSurface::get(surface);
         if (!hdrSurface)
             return pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, pSurfaceFormatCount, pSurfaceFormats);
@@ -276,17 +630,20 @@ public:
         if (result != VK_SUCCESS) {
             return result;
         }
-        std::vector<VkSurfaceFormatKHR> formats(count);
+        auto &formats = hdrSurface->driverFormats;
+        formats.resize(count);
         result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &count, formats.data());
         if (result != VK_SUCCESS) {
             return result;
         }
+        formats.resize(count);
 
         hdrSurface->supportsPassthrough = std::ranges::any_of(formats, [](const VkSurfaceFormatKHR fmt) {
             return fmt.colorSpace == VK_COLOR_SPACE_PASS_THROUGH_EXT;
         });
 
-        std::vector<VkSurfaceFormatKHR> extraFormats = {};
+        auto &extraFormats = hdrSurface->extraFormats;
+        extraFormats.clear();
         for (const auto &desc : s_ExtraHDRSurfaceFormats) {
             const bool alreadySupportsColorspace = std::ranges::any_of(formats, [&desc](const VkSurfaceFormatKHR fmt) {
                 return desc.surface.surfaceFormat.format == fmt.format
@@ -298,15 +655,8 @@ public:
             bool hasFormat = std::ranges::any_of(formats, [&desc](const VkSurfaceFormatKHR fmt) {
                 return desc.surface.surfaceFormat.format == fmt.format;
             });
-            if (hdrSurface->xxColorSurface) {
-                hasFormat &= std::ranges::find(hdrSurface->xxSupportedPrimaries, desc.xxPrimaries) != hdrSurface->xxSupportedPrimaries.end();
-                hasFormat &= std::ranges::find(hdrSurface->xxSupportedTransferFunctions, desc.xxTransferFunction) != hdrSurface->xxSupportedTransferFunctions.end();
-            }
-            if (hdrSurface->colorSurface) {
-                hasFormat &= std::ranges::find(hdrSurface->supportedPrimaries, desc.primaries) != hdrSurface->supportedPrimaries.end();
-                hasFormat &= std::ranges::find(hdrSurface->supportedTransferFunctions, desc.transferFunction) != hdrSurface->supportedTransferFunctions.end();
-                hasFormat &= !desc.extended_volume || std::ranges::find(hdrSurface->supportedFeatures, WP_COLOR_MANAGER_V1_FEATURE_EXTENDED_TARGET_VOLUME) != hdrSurface->supportedFeatures.end();
-            }
+            hasFormat |= hdrSurface->headless && HeadlessSupportsFormat(pDispatch, physicalDevice, desc);
+            hasFormat &= SurfaceSupportsDescription(*hdrSurface.get(), desc);
             if (hasFormat) {
                 fprintf(stderr, "[HDR Layer] Enabling format: %u colorspace: %u\n", desc.surface.surfaceFormat.format, desc.surface.surfaceFormat.colorSpace);
                 extraFormats.push_back(desc.surface.surfaceFormat);
@@ -329,6 +679,9 @@ public:
         uint32_t *pSurfaceFormatCount,
         VkSurfaceFormat2KHR *pSurfaceFormats)
     {
+        if (!InstanceUsesColorSpaces(pDispatch->Instance) || !ProbeSurface(pSurfaceInfo->surface)) {
+            return pDispatch->GetPhysicalDeviceSurfaceFormats2KHR(physicalDevice, pSurfaceInfo, pSurfaceFormatCount, pSurfaceFormats);
+        }
         auto hdrSurface = HdrSurface::get(pSurfaceInfo->surface);
         if (!hdrSurface) {
             return pDispatch->GetPhysicalDeviceSurfaceFormats2KHR(physicalDevice, pSurfaceInfo, pSurfaceFormatCount, pSurfaceFormats);
@@ -339,17 +692,20 @@ public:
         if (result != VK_SUCCESS) {
             return result;
         }
-        std::vector<VkSurfaceFormatKHR> formats(count);
+        auto &formats = hdrSurface->driverFormats;
+        formats.resize(count);
         result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, pSurfaceInfo->surface, &count, formats.data());
         if (result != VK_SUCCESS) {
             return result;
         }
+        formats.resize(count);
 
         hdrSurface->supportsPassthrough = std::ranges::any_of(formats, [](const VkSurfaceFormatKHR fmt) {
             return fmt.colorSpace == VK_COLOR_SPACE_PASS_THROUGH_EXT;
         });
 
-        std::vector<VkSurfaceFormat2KHR> extraFormats = {};
+        auto &extraFormats = hdrSurface->extraFormats2;
+        extraFormats.clear();
         for (const auto &desc : s_ExtraHDRSurfaceFormats) {
             const bool alreadySupportsColorspace = std::ranges::any_of(formats, [&desc](const VkSurfaceFormatKHR fmt) {
                 return desc.surface.surfaceFormat.format == fmt.format
@@ -361,14 +717,8 @@ public:
             bool hasFormat = std::ranges::any_of(formats, [&desc](const VkSurfaceFormatKHR fmt) {
                 return desc.surface.surfaceFormat.format == fmt.format;
             });
-            if (hdrSurface->xxColorSurface) {
-                hasFormat &= std::ranges::find(hdrSurface->xxSupportedPrimaries, desc.xxPrimaries) != hdrSurface->xxSupportedPrimaries.end();
-                hasFormat &= std::ranges::find(hdrSurface->xxSupportedTransferFunctions, desc.xxTransferFunction) != hdrSurface->xxSupportedTransferFunctions.end();
-            }
-            if (hdrSurface->colorSurface) {
-                hasFormat &= std::ranges::find(hdrSurface->supportedPrimaries, desc.primaries) != hdrSurface->supportedPrimaries.end();
-                hasFormat &= std::ranges::find(hdrSurface->supportedTransferFunctions, desc.transferFunction) != hdrSurface->supportedTransferFunctions.end();
-            }
+            hasFormat |= hdrSurface->headless && HeadlessSupportsFormat(pDispatch, physicalDevice, desc);
+            hasFormat &= SurfaceSupportsDescription(*hdrSurface.get(), desc);
             if (hasFormat) {
                 fprintf(stderr, "[HDR Layer] Enabling format: %u colorspace: %u\n", desc.surface.surfaceFormat.format, desc.surface.surfaceFormat.colorSpace);
                 extraFormats.push_back(desc.surface);
@@ -394,27 +744,55 @@ public:
             if (state->frogColorSurface) {
                 frog_color_managed_surface_destroy(state->frogColorSurface);
             }
-            if (state->frogColorManagement) {
-                frog_color_management_factory_v1_destroy(state->frogColorManagement);
-            }
             if (state->xxColorSurface) {
                 xx_color_management_surface_v4_destroy(state->xxColorSurface);
             }
-            if (state->xxColorManager) {
-                xx_color_manager_v4_destroy(state->xxColorManager);
+            if (state->feedback) {
+                wp_color_management_surface_feedback_v1_destroy(state->feedback);
             }
             if (state->colorSurface) {
                 wp_color_management_surface_v1_destroy(state->colorSurface);
             }
-            if (state->colorManager) {
-                wp_color_manager_v1_destroy(state->colorManager);
+            if (state->colorRepresentationSurface) {
+                wp_color_representation_surface_v1_destroy(state->colorRepresentationSurface);
+            }
+            DestroyGlobals(*state.get());
+            if (state->sinkFd >= 0) {
+                close(state->sinkFd);
+            }
+            if (state->sinkDropped) {
+                fprintf(stderr, "[HDR Layer] Headless sink fell behind, dropped %" PRIu64 " presents\n", state->sinkDropped);
             }
-            wl_event_queue_destroy(state->queue);
         }
         HdrSurface::remove(surface);
         pDispatch->DestroySurfaceKHR(instance, surface, pAllocator);
     }
 
+    static VkResult CreateDevice(
+        const vkroots::VkInstanceDispatch *pDispatch,
+        VkPhysicalDevice physicalDevice,
+        const VkDeviceCreateInfo *pCreateInfo,
+        const VkAllocationCallbacks *pAllocator,
+        VkDevice *pDevice)
+    {
+        // The VK_HDRWSI_* extensions only exist in this layer, the driver would refuse them
+        std::vector<const char *> extensions;
+        for (uint32_t i = 0; i < pCreateInfo->enabledExtensionCount; i++) {
+            if (!std::string_view(pCreateInfo->ppEnabledExtensionNames[i]).starts_with("VK_HDRWSI_")) {
+                extensions.push_back(pCreateInfo->ppEnabledExtensionNames[i]);
+            }
+        }
+
+        VkDeviceCreateInfo createInfo = *pCreateInfo;
+        createInfo.enabledExtensionCount = uint32_t(extensions.size());
+        createInfo.ppEnabledExtensionNames = extensions.data();
+        VkResult result = pDispatch->CreateDevice(physicalDevice, &createInfo, pAllocator, pDevice);
+        if (result == VK_SUCCESS) {
+            HdrDevice::create(*pDevice, HdrDeviceData{});
+        }
+        return result;
+    }
+
     static VkResult
     EnumerateDeviceExtensionProperties(
         const vkroots::VkInstanceDispatch *pDispatch,
@@ -423,17 +801,39 @@ public:
         uint32_t *pPropertyCount,
         VkExtensionProperties *pProperties)
     {
-        static constexpr std::array<VkExtensionProperties, 1> s_LayerExposedExts = {{
-                {
-                    VK_EXT_HDR_METADATA_EXTENSION_NAME,
-                    VK_EXT_HDR_METADATA_SPEC_VERSION
-                },
-            }
+        std::vector<VkExtensionProperties> layerExposedExts = {
+            {
+                VK_EXT_HDR_METADATA_EXTENSION_NAME,
+                VK_EXT_HDR_METADATA_SPEC_VERSION
+            },
         };
 
+        // The VK_HDRWSI_* structures only act on swapchains for surfaces the layer
+        // tracks, and only name non-sRGB color spaces with VK_EXT_swapchain_colorspace
+        HdrInstanceData instanceData;
+        if (auto hdrInstance = HdrInstance::get(pDispatch->Instance)) {
+            instanceData = *hdrInstance.get();
+        }
+        if (DeviceSupportsExtension(pDispatch, physicalDevice, VK_KHR_SWAPCHAIN_EXTENSION_NAME)) {
+            if (instanceData.swapchainColorspace && (instanceData.waylandSurface || instanceData.headlessSurface)) {
+                layerExposedExts.push_back({
+                    VK_HDRWSI_PRESENT_COLOR_SPACE_EXTENSION_NAME,
+                    VK_HDRWSI_PRESENT_COLOR_SPACE_SPEC_VERSION
+                });
+            }
+            // VK_HDRWSI_swapchain_color_representation stays unreported until a
+            // driver's Wayland WSI offers a multi-planar format to chain it to
+            if (instanceData.waylandSurface) {
+                layerExposedExts.push_back({
+                    VK_HDRWSI_SWAPCHAIN_SDR_OVERLAY_EXTENSION_NAME,
+                    VK_HDRWSI_SWAPCHAIN_SDR_OVERLAY_SPEC_VERSION
+                });
+            }
+        }
+
         if (pLayerName) {
             if (pLayerName == "VK_LAYER_hdr_wsi"sv) {
-                return vkroots::helpers::array(s_LayerExposedExts, pPropertyCount, pProperties);
+                return vkroots::helpers::array(layerExposedExts, pPropertyCount, pProperties);
             } else {
                 return pDispatch->EnumerateDeviceExtensionProperties(physicalDevice, pLayerName, pPropertyCount, pProperties);
             }
@@ -441,7 +841,7 @@ public:
 
         return vkroots::helpers::append(
                    pDispatch->EnumerateDeviceExtensionProperties,
-                   s_LayerExposedExts,
+                   layerExposedExts,
                    pPropertyCount,
                    pProperties,
                    physicalDevice,
@@ -449,6 +849,186 @@ public:
     }
 
 private:
+    friend class VkDeviceOverrides;
+
+    static bool DeviceSupportsExtension(const vkroots::VkInstanceDispatch *pDispatch, VkPhysicalDevice physicalDevice, std::string_view name)
+    {
+        uint32_t count = 0;
+        pDispatch->EnumerateDeviceExtensionProperties(physicalDevice, nullptr, &count, nullptr);
+        std::vector<VkExtensionProperties> extensions(count);
+        pDispatch->EnumerateDeviceExtensionProperties(physicalDevice, nullptr, &count, extensions.data());
+        extensions.resize(count);
+        return std::ranges::any_of(extensions, [name](const VkExtensionProperties &extension) {
+            return extension.extensionName == name;
+        });
+    }
+
+    // Without VK_EXT_swapchain_colorspace the app can't name the extra color
+    // spaces, so there is no reason to make its format queries wait on the compositor.
+    static bool InstanceUsesColorSpaces(VkInstance instance)
+    {
+        auto hdrInstance = HdrInstance::get(instance);
+        return hdrInstance && hdrInstance->swapchainColorspace;
+    }
+
+    // Binds the color management globals, returns false if the compositor
+    // can't tag this surface. Takes the surface map lock itself, callers must
+    // not hold it.
+    static bool ProbeSurface(VkSurfaceKHR handle)
+    {
+        wl_display *display;
+        {
+            auto hdrSurface = HdrSurface::get(handle);
+            if (!hdrSurface) {
+                return false;
+            }
+            if (hdrSurface->probed) {
+                return !hdrSurface->inactive;
+            }
+            display = hdrSurface->display;
+        }
+
+        // The roundtrips wait on the compositor, so they fill a copy without the
+        // lock held, which every other surface's format query and present needs.
+        HdrSurfaceData probe = {
+            .display = display,
+        };
+        probe.queue = wl_display_create_queue(display);
+        wl_registry *registry = wl_display_get_registry(display);
+        wl_proxy_set_queue(reinterpret_cast<wl_proxy *>(registry), probe.queue);
+        wl_registry_add_listener(registry, &s_registryListener, &probe);
+        wl_display_dispatch_queue(display, probe.queue);
+        wl_display_roundtrip_queue(display, probe.queue); // get globals
+        wl_display_roundtrip_queue(display, probe.queue); // get features/supported_cicps/etc
+        wl_registry_destroy(registry);
+
+        auto hdrSurface = HdrSurface::get(handle);
+        if (!hdrSurface || hdrSurface->probed) {
+            // destroyed or probed by another thread in the meantime
+            DestroyGlobals(probe);
+            return hdrSurface && !hdrSurface->inactive;
+        }
+        auto &surface = *hdrSurface.get();
+        surface.probed = true;
+        surface.queue = probe.queue;
+        surface.frogColorManagement = probe.frogColorManagement;
+        surface.xxColorManager = probe.xxColorManager;
+        surface.xxSupportedFeatures = probe.xxSupportedFeatures;
+        surface.xxSupportedPrimaries = probe.xxSupportedPrimaries;
+        surface.xxSupportedTransferFunctions = probe.xxSupportedTransferFunctions;
+        surface.colorManager = probe.colorManager;
+        surface.supportedFeatures = probe.supportedFeatures;
+        surface.supportedPrimaries = probe.supportedPrimaries;
+        surface.supportedTransferFunctions = probe.supportedTransferFunctions;
+        surface.colorRepresentationManager = probe.colorRepresentationManager;
+        surface.supportedCoefficients = probe.supportedCoefficients;
+        surface.compositor = probe.compositor;
+        surface.subcompositor = probe.subcompositor;
+        // the listeners still point at the copy
+        if (surface.xxColorManager) {
+            xx_color_manager_v4_set_user_data(surface.xxColorManager, &surface);
+        }
+        if (surface.colorManager) {
+            wp_color_manager_v1_set_user_data(surface.colorManager, &surface);
+        }
+        if (surface.colorRepresentationManager) {
+            wp_color_representation_manager_v1_set_user_data(surface.colorRepresentationManager, &surface);
+        }
+
+        if (!surface.frogColorManagement && !surface.xxColorManager && !surface.colorManager) {
+            fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for color management protocols..\n");
+            surface.inactive = true;
+        } else if ((UsesColorManagement(surface) && !surface.supportedFeatures.contains(WP_COLOR_MANAGER_V1_FEATURE_PARAMETRIC))
+                   || (UsesXxColorManagement(surface) && !surface.xxSupportedFeatures.contains(XX_COLOR_MANAGER_V4_FEATURE_PARAMETRIC))) {
+            fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for parametric image descriptions\n");
+            surface.inactive = true;
+        }
+        return !surface.inactive;
+    }
+
+    // The globals a probe binds, and its queue.
+    static void DestroyGlobals(HdrSurfaceData &surface)
+    {
+        if (surface.frogColorManagement) {
+            frog_color_management_factory_v1_destroy(surface.frogColorManagement);
+        }
+        if (surface.xxColorManager) {
+            xx_color_manager_v4_destroy(surface.xxColorManager);
+        }
+        if (surface.colorManager) {
+            wp_color_manager_v1_destroy(surface.colorManager);
+        }
+        if (surface.colorRepresentationManager) {
+            wp_color_representation_manager_v1_destroy(surface.colorRepresentationManager);
+        }
+        if (surface.subcompositor) {
+            wl_subcompositor_destroy(surface.subcompositor);
+        }
+        if (surface.compositor) {
+            wl_compositor_destroy(surface.compositor);
+        }
+        if (surface.queue) {
+            wl_event_queue_destroy(surface.queue);
+        }
+    }
+
+    // Creates the per-surface color management objects, which from then on
+    // the compositor applies to everything presented on the surface. The
+    // surface has to be probed first, see ProbeSurface.
+    static bool ActivateSurface(HdrSurfaceData &surface)
+    {
+        if (surface.activated || !surface.probed || surface.inactive) {
+            return surface.activated;
+        }
+        surface.activated = true;
+
+        if (surface.frogColorManagement) {
+            surface.frogColorSurface = frog_color_management_factory_v1_get_color_managed_surface(surface.frogColorManagement, surface.surface);
+            frog_color_managed_surface_add_listener(surface.frogColorSurface, &color_surface_interface_listener, nullptr);
+            wl_display_flush(surface.display);
+        } else if (surface.colorManager) {
+            surface.colorSurface = wp_color_manager_v1_get_surface(surface.colorManager, surface.surface);
+            if (MatchPreferredEnabled()) {
+                surface.feedback = wp_color_manager_v1_get_surface_feedback(surface.colorManager, surface.surface);
+                wp_color_management_surface_feedback_v1_add_listener(surface.feedback, &s_feedbackListener, &surface);
+                UpdatePreferredDescription(surface);
+            }
+        } else {
+            surface.xxColorSurface = xx_color_manager_v4_get_surface(surface.xxColorManager, surface.surface);
+        }
+
+        fprintf(stderr, "[HDR Layer] Created HDR surface\n");
+        return true;
+    }
+
+    // HDR_WSI_HEADLESS_SINK is either a file to append to, or unix:<path> of a listening socket
+    static void OpenHeadlessSink(HdrSurfaceData &surface)
+    {
+        const char *sink = getenv("HDR_WSI_HEADLESS_SINK");
+        if (!sink) {
+            return;
+        }
+
+        if (strncmp(sink, "unix:", 5) == 0) {
+            sockaddr_un address = {
+                .sun_family = AF_UNIX,
+            };
+            strncpy(address.sun_path, sink + 5, sizeof(address.sun_path) - 1);
+            surface.sinkFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (surface.sinkFd >= 0 && connect(surface.sinkFd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0) {
+                close(surface.sinkFd);
+                surface.sinkFd = -1;
+            }
+            surface.sinkIsSocket = true;
+        } else {
+            surface.sinkFd = open(sink, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        }
+
+        if (surface.sinkFd < 0) {
+            fprintf(stderr, "[HDR Layer] Failed to open headless sink %s: %s\n", sink, strerror(errno));
+        }
+    }
+
     static constexpr struct frog_color_managed_surface_listener color_surface_interface_listener {
       .preferred_metadata = [](void *data,
                                struct frog_color_managed_surface *frog_color_managed_surface,
@@ -470,13 +1050,13 @@ private:
         .supported_intent = [](void *data, xx_color_manager_v4 *xx_color_manager_v4, uint32_t render_intent) {
         },
         .supported_feature = [](void *data, xx_color_manager_v4 *xx_color_manager_v4, uint32_t feature) {
-            reinterpret_cast<HdrSurfaceData *>(data)->xxSupportedFeatures.push_back(xx_color_manager_v4_feature(feature));
+            reinterpret_cast<HdrSurfaceData *>(data)->xxSupportedFeatures.insert(xx_color_manager_v4_feature(feature));
         },
         .supported_tf_named = [](void *data, xx_color_manager_v4 *xx_color_manager_v4, uint32_t tf) {
-            reinterpret_cast<HdrSurfaceData *>(data)->xxSupportedTransferFunctions.push_back(xx_color_manager_v4_transfer_function(tf));
+            reinterpret_cast<HdrSurfaceData *>(data)->xxSupportedTransferFunctions.insert(xx_color_manager_v4_transfer_function(tf));
         },
         .supported_primaries_named = [](void *data, xx_color_manager_v4 *xx_color_manager_v4, uint32_t primaries) {
-            reinterpret_cast<HdrSurfaceData *>(data)->xxSupportedPrimaries.push_back(xx_color_manager_v4_primaries(primaries));
+            reinterpret_cast<HdrSurfaceData *>(data)->xxSupportedPrimaries.insert(xx_color_manager_v4_primaries(primaries));
         },
     };
 
@@ -484,18 +1064,31 @@ private:
         .supported_intent = [](void *data, wp_color_manager_v1 *wp_color_manager_v4, uint32_t render_intent) {
         },
         .supported_feature = [](void *data, wp_color_manager_v1 *wp_color_manager_v4, uint32_t feature) {
-            reinterpret_cast<HdrSurfaceData *>(data)->supportedFeatures.push_back(wp_color_manager_v1_feature(feature));
+            reinterpret_cast<HdrSurfaceData *>(data)->supportedFeatures.insert(wp_color_manager_v1_feature(feature));
         },
         .supported_tf_named = [](void *data, wp_color_manager_v1 *wp_color_manager_v4, uint32_t tf) {
-            reinterpret_cast<HdrSurfaceData *>(data)->supportedTransferFunctions.push_back(wp_color_manager_v1_transfer_function(tf));
+            reinterpret_cast<HdrSurfaceData *>(data)->supportedTransferFunctions.insert(wp_color_manager_v1_transfer_function(tf));
         },
         .supported_primaries_named = [](void *data, wp_color_manager_v1 *wp_color_manager_v4, uint32_t primaries) {
-            reinterpret_cast<HdrSurfaceData *>(data)->supportedPrimaries.push_back(wp_color_manager_v1_primaries(primaries));
+            reinterpret_cast<HdrSurfaceData *>(data)->supportedPrimaries.insert(wp_color_manager_v1_primaries(primaries));
         },
         .done = [](void *data, wp_color_manager_v1 *wp_color_manager_v4) {
         },
     };
 
+    static constexpr wp_color_representation_manager_v1_listener s_colorRepresentationManagerListener {
+        .supported_alpha_mode = [](void *data, wp_color_representation_manager_v1 *manager, uint32_t alpha_mode) {
+        },
+        .supported_coefficients_and_ranges = [](void *data, wp_color_representation_manager_v1 *manager, uint32_t coefficients, uint32_t range) {
+            auto &supportedCoefficients = reinterpret_cast<HdrSurfaceData *>(data)->supportedCoefficients;
+            if (range < supportedCoefficients.size()) {
+                supportedCoefficients[range].insert(wp_color_representation_surface_v1_coefficients(coefficients));
+            }
+        },
+        .done = [](void *data, wp_color_representation_manager_v1 *manager) {
+        },
+    };
+
     static constexpr wl_registry_listener s_registryListener = {
         .global = [](void *data, wl_registry * registry, uint32_t name, const char *interface, uint32_t version)
         {
@@ -509,6 +1102,13 @@ private:
             } else if (interface == "wp_color_manager_v1"sv) {
                 surface->colorManager = reinterpret_cast<wp_color_manager_v1 *>(wl_registry_bind(registry, name, &wp_color_manager_v1_interface, 1));
                 wp_color_manager_v1_add_listener(surface->colorManager, &s_colorManagerListener, surface);
+            } else if (interface == "wl_compositor"sv) {
+                surface->compositor = reinterpret_cast<wl_compositor *>(wl_registry_bind(registry, name, &wl_compositor_interface, 1));
+            } else if (interface == "wl_subcompositor"sv) {
+                surface->subcompositor = reinterpret_cast<wl_subcompositor *>(wl_registry_bind(registry, name, &wl_subcompositor_interface, 1));
+            } else if (interface == "wp_color_representation_manager_v1"sv) {
+                surface->colorRepresentationManager = reinterpret_cast<wp_color_representation_manager_v1 *>(wl_registry_bind(registry, name, &wp_color_representation_manager_v1_interface, 1));
+                wp_color_representation_manager_v1_add_listener(surface->colorRepresentationManager, &s_colorRepresentationManagerListener, surface);
             }
         },
         .global_remove = [](void *data, wl_registry * registry, uint32_t name) {},
@@ -534,18 +1134,991 @@ static constexpr wp_image_description_v1_listener s_imageDescriptionListener {
     },
 };
 
-class VkDeviceOverrides
+static uint32_t SurfaceId(const HdrSurfaceData &surface)
 {
-public:
-    static void DestroySwapchainKHR(
-        const vkroots::VkDeviceDispatch *pDispatch,
-        VkDevice device,
-        VkSwapchainKHR swapchain,
-        const VkAllocationCallbacks *pAllocator)
-    {
-        HdrSwapchain::remove(swapchain);
-        pDispatch->DestroySwapchainKHR(device, swapchain, pAllocator);
-    }
+    return surface.surface ? wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(surface.surface)) : 0;
+}
+
+template <typename T>
+static const T *FindLayerStruct(const void *pNext, VkStructureType sType)
+{
+    for (auto header = reinterpret_cast<const VkBaseInStructure *>(pNext); header; header = header->pNext) {
+        if (header->sType == sType) {
+            return reinterpret_cast<const T *>(header);
+        }
+    }
+    return nullptr;
+}
+
+static const ColorDescription *FindColorDescription(VkColorSpaceKHR colorSpace)
+{
+    const auto it = std::ranges::find_if(s_ExtraHDRSurfaceFormats, [colorSpace](const ColorDescription &description) {
+        return description.surface.surfaceFormat.colorSpace == colorSpace;
+    });
+    return it != s_ExtraHDRSurfaceFormats.end() ? &*it : nullptr;
+}
+
+static void RetagSwapchain(const HdrSurfaceData &surface, HdrSwapchainData &swapchain, VkColorSpaceKHR colorSpace)
+{
+    const bool compatible = colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR
+        || std::ranges::any_of(s_ExtraHDRSurfaceFormats, [&surface, &swapchain, colorSpace](const ColorDescription &description) {
+               return description.surface.surfaceFormat.format == swapchain.format
+                   && description.surface.surfaceFormat.colorSpace == colorSpace
+                   && SurfaceSupportsDescription(surface, description);
+           });
+    if (!compatible) {
+        fprintf(stderr, "[HDR Layer] Ignoring retag to colorspace %s, not supported with format %s on this surface\n",
+                vkroots::helpers::enumString(colorSpace),
+                vkroots::helpers::enumString(swapchain.format));
+        return;
+    }
+
+    swapchain.colorSpace = colorSpace;
+    swapchain.description = FindColorDescription(colorSpace);
+    swapchain.desc_dirty = true;
+}
+
+// Mastering metadata in color-management-v1 units
+struct MasteringParams {
+    std::array<int32_t, 8> primaries;
+    uint32_t minLuminance;
+    uint32_t maxLuminance;
+    uint32_t maxCll;
+    uint32_t maxFall;
+};
+
+// Narrows the app's metadata to the output's target volume, where that doesn't
+// claim more than the content has, so the tag can equal the preferred one.
+// Values the app left at 0 stay unset, filling them in would describe content
+// the app never described. Returns whether the tag equals the preferred one.
+static bool AdaptToPreferred(MasteringParams &params, const PreferredDescription &preferred, bool hasMasteringPrimaries)
+{
+    const auto clampMax = [](uint32_t &value, uint32_t target) {
+        if (target && value) {
+            value = std::min(value, target);
+        }
+    };
+    clampMax(params.maxLuminance, preferred.targetMaxLuminance);
+    clampMax(params.maxCll, preferred.targetMaxCll);
+    clampMax(params.maxFall, preferred.targetMaxFall);
+    // a minimum only means something next to the maximum it belongs to
+    if (preferred.targetMaxLuminance && params.maxLuminance) {
+        params.minLuminance = std::max(params.minLuminance, preferred.targetMinLuminance);
+    }
+
+    if (!hasMasteringPrimaries) {
+        return !preferred.targetMaxLuminance && !preferred.targetPrimaries;
+    }
+    return params.minLuminance == preferred.targetMinLuminance
+        && params.maxLuminance == preferred.targetMaxLuminance
+        && (!preferred.targetPrimaries || params.primaries == *preferred.targetPrimaries)
+        && (!preferred.targetMaxCll || params.maxCll == preferred.targetMaxCll)
+        && (!preferred.targetMaxFall || params.maxFall == preferred.targetMaxFall);
+}
+
+static bool SameHdrMetadata(const VkHdrMetadataEXT &a, const VkHdrMetadataEXT &b)
+{
+    auto values = [](const VkHdrMetadataEXT &m) {
+        return std::tie(m.displayPrimaryRed.x, m.displayPrimaryRed.y,
+                        m.displayPrimaryGreen.x, m.displayPrimaryGreen.y,
+                        m.displayPrimaryBlue.x, m.displayPrimaryBlue.y,
+                        m.whitePoint.x, m.whitePoint.y,
+                        m.maxLuminance, m.minLuminance,
+                        m.maxContentLightLevel, m.maxFrameAverageLightLevel);
+    };
+    return values(a) == values(b);
+}
+
+static std::optional<ColorRepresentation> ResolveColorRepresentation(const HdrSurfaceData &surface, const VkSwapchainCreateInfoKHR &createInfo)
+{
+    const bool ycbcr = std::ranges::any_of(s_ExtraHDRSurfaceFormats, [&createInfo](const ColorDescription &description) {
+        return description.ycbcr && description.surface.surfaceFormat.format == createInfo.imageFormat;
+    });
+    if (!ycbcr || !surface.colorRepresentationManager) {
+        return std::nullopt;
+    }
+
+    VkSwapchainColorRepresentationCreateInfoHDRWSI info = {
+        .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_COLOR_REPRESENTATION_CREATE_INFO_HDRWSI,
+        .ycbcrModel = VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_2020,
+        .ycbcrRange = VK_SAMPLER_YCBCR_RANGE_ITU_NARROW,
+        .xChromaOffset = VK_CHROMA_LOCATION_COSITED_EVEN,
+        .yChromaOffset = VK_CHROMA_LOCATION_MIDPOINT,
+    };
+    if (auto requested = FindLayerStruct<VkSwapchainColorRepresentationCreateInfoHDRWSI>(createInfo.pNext, VK_STRUCTURE_TYPE_SWAPCHAIN_COLOR_REPRESENTATION_CREATE_INFO_HDRWSI)) {
+        info = *requested;
+    }
+
+    ColorRepresentation representation;
+    switch (info.ycbcrModel) {
+        case VK_SAMPLER_YCBCR_MODEL_CONVERSION_RGB_IDENTITY:
+            representation.coefficients = WP_COLOR_REPRESENTATION_SURFACE_V1_COEFFICIENTS_IDENTITY;
+            break;
+        case VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_709:
+            representation.coefficients = WP_COLOR_REPRESENTATION_SURFACE_V1_COEFFICIENTS_BT709;
+            break;
+        case VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_601:
+            representation.coefficients = WP_COLOR_REPRESENTATION_SURFACE_V1_COEFFICIENTS_BT601;
+            break;
+        case VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_2020:
+            representation.coefficients = WP_COLOR_REPRESENTATION_SURFACE_V1_COEFFICIENTS_BT2020;
+            break;
+        default:
+            fprintf(stderr, "[HDR Layer] Unsupported YCbCr model %u, leaving color representation unset\n", uint32_t(info.ycbcrModel));
+            return std::nullopt;
+    }
+    representation.range = info.ycbcrRange == VK_SAMPLER_YCBCR_RANGE_ITU_FULL
+        ? WP_COLOR_REPRESENTATION_SURFACE_V1_RANGE_FULL
+        : WP_COLOR_REPRESENTATION_SURFACE_V1_RANGE_LIMITED;
+
+    // H.273 Chroma420SampleLocType
+    const bool xCosited = info.xChromaOffset == VK_CHROMA_LOCATION_COSITED_EVEN;
+    const bool yCosited = info.yChromaOffset == VK_CHROMA_LOCATION_COSITED_EVEN;
+    if (xCosited) {
+        representation.chromaLocation = yCosited ? WP_COLOR_REPRESENTATION_SURFACE_V1_CHROMA_LOCATION_TYPE_2 : WP_COLOR_REPRESENTATION_SURFACE_V1_CHROMA_LOCATION_TYPE_0;
+    } else {
+        representation.chromaLocation = yCosited ? WP_COLOR_REPRESENTATION_SURFACE_V1_CHROMA_LOCATION_TYPE_3 : WP_COLOR_REPRESENTATION_SURFACE_V1_CHROMA_LOCATION_TYPE_1;
+    }
+
+    const bool supported = surface.supportedCoefficients[representation.range].contains(representation.coefficients);
+    if (!supported) {
+        fprintf(stderr, "[HDR Layer] Compositor doesn't support coefficients %u with range %u, leaving color representation unset\n",
+                representation.coefficients, representation.range);
+        return std::nullopt;
+    }
+    return representation;
+}
+
+static wp_image_description_v1 *CreateImageDescription(const HdrSurfaceData &surface, const ColorDescription &description, const VkHdrMetadataEXT &metadata,
+                                                       bool *pMatchesPreferred, VkHdrMetadataEXT *pSentMetadata)
+{
+    constexpr double primaryUnit = 1'000'000.0;
+    MasteringParams params = {
+        .primaries = {
+            int32_t(std::round(metadata.displayPrimaryRed.x * primaryUnit)),
+            int32_t(std::round(metadata.displayPrimaryRed.y * primaryUnit)),
+            int32_t(std::round(metadata.displayPrimaryGreen.x * primaryUnit)),
+            int32_t(std::round(metadata.displayPrimaryGreen.y * primaryUnit)),
+            int32_t(std::round(metadata.displayPrimaryBlue.x * primaryUnit)),
+            int32_t(std::round(metadata.displayPrimaryBlue.y * primaryUnit)),
+            int32_t(std::round(metadata.whitePoint.x * primaryUnit)),
+            int32_t(std::round(metadata.whitePoint.y * primaryUnit)),
+        },
+        .minLuminance = uint32_t(std::round(metadata.minLuminance * 10'000.0)),
+        .maxLuminance = uint32_t(std::round(metadata.maxLuminance)),
+        .maxCll = uint32_t(std::round(metadata.maxContentLightLevel)),
+        .maxFall = uint32_t(std::round(metadata.maxFrameAverageLightLevel)),
+    };
+    const bool hasMasteringPrimaries = surface.supportedFeatures.contains(WP_COLOR_MANAGER_V1_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES);
+
+    *pMatchesPreferred = false;
+    if (surface.feedback
+        && surface.preferred.primaries == uint32_t(description.primaries)
+        && surface.preferred.transferFunction == uint32_t(description.transferFunction)) {
+        *pMatchesPreferred = AdaptToPreferred(params, surface.preferred, hasMasteringPrimaries);
+    }
+
+    *pSentMetadata = VkHdrMetadataEXT{
+        .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+        .maxContentLightLevel = float(params.maxCll),
+        .maxFrameAverageLightLevel = float(params.maxFall),
+    };
+    if (hasMasteringPrimaries) {
+        pSentMetadata->displayPrimaryRed = { float(params.primaries[0] / primaryUnit), float(params.primaries[1] / primaryUnit) };
+        pSentMetadata->displayPrimaryGreen = { float(params.primaries[2] / primaryUnit), float(params.primaries[3] / primaryUnit) };
+        pSentMetadata->displayPrimaryBlue = { float(params.primaries[4] / primaryUnit), float(params.primaries[5] / primaryUnit) };
+        pSentMetadata->whitePoint = { float(params.primaries[6] / primaryUnit), float(params.primaries[7] / primaryUnit) };
+        pSentMetadata->maxLuminance = float(params.maxLuminance);
+        pSentMetadata->minLuminance = float(params.minLuminance / 10'000.0);
+    }
+
+    const auto creator = wp_color_manager_v1_create_parametric_creator(surface.colorManager);
+    wp_image_description_creator_params_v1_set_primaries_named(creator, description.primaries);
+    wp_image_description_creator_params_v1_set_tf_named(creator, description.transferFunction);
+    wp_image_description_creator_params_v1_set_max_fall(creator, params.maxFall);
+    wp_image_description_creator_params_v1_set_max_cll(creator, params.maxCll);
+    if (hasMasteringPrimaries) {
+        wp_image_description_creator_params_v1_set_mastering_luminance(creator, params.minLuminance, params.maxLuminance);
+        wp_image_description_creator_params_v1_set_mastering_display_primaries(creator,
+                                                                               params.primaries[0], params.primaries[1],
+                                                                               params.primaries[2], params.primaries[3],
+                                                                               params.primaries[4], params.primaries[5],
+                                                                               params.primaries[6], params.primaries[7]);
+    }
+    const bool hasCustomLuminance = surface.supportedFeatures.contains(WP_COLOR_MANAGER_V1_FEATURE_SET_LUMINANCES);
+    if (hasCustomLuminance && description.transferFunction == WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR) {
+        // NOTE that this assumes that this is Windows-style scRGB
+        wp_image_description_creator_params_v1_set_luminances(creator, 0, 80, 203);
+    }
+    return wp_image_description_creator_params_v1_create(creator);
+}
+
+static xx_image_description_v4 *CreateXxImageDescription(const HdrSurfaceData &surface, const ColorDescription &description, const VkHdrMetadataEXT &metadata,
+                                                         VkHdrMetadataEXT *pSentMetadata)
+{
+    *pSentMetadata = metadata;
+    const auto creator = xx_color_manager_v4_new_parametric_creator(surface.xxColorManager);
+    xx_image_description_creator_params_v4_set_primaries_named(creator, description.xxPrimaries);
+    xx_image_description_creator_params_v4_set_tf_named(creator, description.xxTransferFunction);
+    xx_image_description_creator_params_v4_set_max_fall(creator, std::round(metadata.maxFrameAverageLightLevel));
+    xx_image_description_creator_params_v4_set_max_cll(creator, std::round(metadata.maxContentLightLevel));
+    const bool hasMasteringPrimaries = surface.xxSupportedFeatures.contains(XX_COLOR_MANAGER_V4_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES);
+    if (!hasMasteringPrimaries) {
+        pSentMetadata->displayPrimaryRed = {};
+        pSentMetadata->displayPrimaryGreen = {};
+        pSentMetadata->displayPrimaryBlue = {};
+        pSentMetadata->whitePoint = {};
+        pSentMetadata->minLuminance = 0.0f;
+        pSentMetadata->maxLuminance = 0.0f;
+    } else {
+        xx_image_description_creator_params_v4_set_mastering_luminance(creator, std::round(metadata.minLuminance * 10'000.0), std::round(metadata.maxLuminance));
+        xx_image_description_creator_params_v4_set_mastering_display_primaries(creator,
+            std::round(metadata.displayPrimaryRed.x * 10000.0),
+            std::round(metadata.displayPrimaryRed.y * 10000.0),
+            std::round(metadata.displayPrimaryGreen.x * 10000.0),
+            std::round(metadata.displayPrimaryGreen.y * 10000.0),
+            std::round(metadata.displayPrimaryBlue.x * 10000.0),
+            std::round(metadata.displayPrimaryBlue.y * 10000.0),
+            std::round(metadata.whitePoint.x * 10000.0),
+            std::round(metadata.whitePoint.y * 10000.0)
+        );
+    }
+    const bool hasCustomLuminance = surface.xxSupportedFeatures.contains(XX_COLOR_MANAGER_V4_FEATURE_SET_LUMINANCES);
+    if (hasCustomLuminance && description.xxTransferFunction == XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR) {
+        // NOTE that this assumes that this is Windows-style scRGB
+        xx_image_description_creator_params_v4_set_luminances(creator, 0, 80, 203);
+    }
+    return xx_image_description_creator_params_v4_create(creator);
+}
+
+static void DestroyPreparedDescription(PreparedDescription &prepared)
+{
+    if (prepared.description) {
+        wp_image_description_v1_destroy(prepared.description);
+    }
+    if (prepared.xxDescription) {
+        xx_image_description_v4_destroy(prepared.xxDescription);
+    }
+    prepared = PreparedDescription{};
+}
+
+// Creates the image descriptions for the current color space and every color
+// space the app asked to have prepared, in a single batch. Switching between
+// them afterwards doesn't need another roundtrip until the metadata changes.
+static void PrepareImageDescriptions(HdrSurfaceData &surface, HdrSwapchainData &swapchain)
+{
+    uint32_t mask = swapchain.prepareMask;
+    if (swapchain.description) {
+        mask |= 1u << (swapchain.description - s_ExtraHDRSurfaceFormats.data());
+    }
+
+    bool pending = false;
+    for (uint32_t i = 0; i < swapchain.prepared.size(); i++) {
+        auto &prepared = swapchain.prepared[i];
+        if (!(mask & (1u << i))) {
+            continue;
+        }
+        if ((prepared.description || prepared.xxDescription)
+            && prepared.metadataSerial == swapchain.metadataSerial
+            && prepared.preferredSerial == surface.preferredSerial) {
+            continue;
+        }
+        DestroyPreparedDescription(prepared);
+        prepared.metadataSerial = swapchain.metadataSerial;
+        prepared.preferredSerial = surface.preferredSerial;
+        if (surface.colorSurface) {
+            prepared.description = CreateImageDescription(surface, s_ExtraHDRSurfaceFormats[i], swapchain.metadata,
+                                                          &prepared.matchesPreferred, &prepared.sentMetadata);
+            wp_image_description_v1_add_listener(prepared.description, &s_imageDescriptionListener, &prepared.done);
+        } else {
+            prepared.xxDescription = CreateXxImageDescription(surface, s_ExtraHDRSurfaceFormats[i], swapchain.metadata, &prepared.sentMetadata);
+            xx_image_description_v4_add_listener(prepared.xxDescription, &s_xxImageDescriptionListener, &prepared.done);
+        }
+        pending = true;
+    }
+    if (!pending) {
+        return;
+    }
+
+    const auto allDone = [&swapchain] {
+        return std::ranges::all_of(swapchain.prepared, [](const PreparedDescription &prepared) {
+            return prepared.done || (!prepared.description && !prepared.xxDescription);
+        });
+    };
+    wl_display_dispatch_queue(surface.display, surface.queue);
+    // In theory the compositor could wait for a while here. In practice it doesn't.
+    while (!allDone()) {
+        wl_display_roundtrip_queue(surface.display, surface.queue);
+    }
+}
+
+static void CloseHeadlessSink(HdrSurfaceData &surface)
+{
+    fprintf(stderr, "[HDR Layer] Writing to headless sink failed, closing it: %s\n", strerror(errno));
+    close(surface.sinkFd);
+    surface.sinkFd = -1;
+}
+
+// Presents hold the surface map lock while writing, so a socket that can't keep
+// up gets lines dropped instead of stalling every present.
+static bool FlushHeadlessSink(HdrSurfaceData &surface)
+{
+    while (surface.sinkPendingLength) {
+        const ssize_t sent = send(surface.sinkFd, surface.sinkPending.data() + surface.sinkPendingOffset, surface.sinkPendingLength,
+                                  MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                CloseHeadlessSink(surface);
+            }
+            return false;
+        }
+        surface.sinkPendingOffset += sent;
+        surface.sinkPendingLength -= sent;
+    }
+    return true;
+}
+
+// Reports what would have been sent to the compositor as one JSON object per line.
+// primaries and transferFunction use the color-management-v1 enum values, 0 if untagged.
+static void WriteHeadlessPresent(HdrSurfaceData &surface, const HdrSwapchainData &swapchain, uint32_t imageIndex)
+{
+    if (surface.sinkFd < 0) {
+        return;
+    }
+    if (surface.sinkIsSocket && !FlushHeadlessSink(surface)) {
+        surface.sinkDropped++;
+        return;
+    }
+
+    const ColorDescription *description = swapchain.description;
+    const auto &metadata = swapchain.metadata;
+    char line[1024];
+    const int length = snprintf(line, sizeof(line),
+                                "{\"present\": %" PRIu64 ", \"image\": %u, \"format\": \"%s\", \"colorSpace\": \"%s\", "
+                                "\"primaries\": %u, \"transferFunction\": %u, "
+                                "\"displayPrimaries\": [[%f, %f], [%f, %f], [%f, %f]], \"whitePoint\": [%f, %f], "
+                                "\"minLuminance\": %f, \"maxLuminance\": %f, \"maxContentLightLevel\": %f, \"maxFrameAverageLightLevel\": %f}\n",
+                                swapchain.presentCount,
+                                imageIndex,
+                                vkroots::helpers::enumString(swapchain.format),
+                                vkroots::helpers::enumString(swapchain.colorSpace),
+                                description ? uint32_t(description->primaries) : 0u,
+                                description ? uint32_t(description->transferFunction) : 0u,
+                                metadata.displayPrimaryRed.x, metadata.displayPrimaryRed.y,
+                                metadata.displayPrimaryGreen.x, metadata.displayPrimaryGreen.y,
+                                metadata.displayPrimaryBlue.x, metadata.displayPrimaryBlue.y,
+                                metadata.whitePoint.x, metadata.whitePoint.y,
+                                metadata.minLuminance,
+                                metadata.maxLuminance,
+                                metadata.maxContentLightLevel,
+                                metadata.maxFrameAverageLightLevel);
+    if (length <= 0) {
+        return;
+    }
+
+    const size_t size = std::min(size_t(length), sizeof(line) - 1);
+    if (!surface.sinkIsSocket) {
+        if (write(surface.sinkFd, line, size) < 0) {
+            CloseHeadlessSink(surface);
+        }
+        return;
+    }
+
+    const ssize_t sent = send(surface.sinkFd, line, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            surface.sinkDropped++;
+        } else {
+            CloseHeadlessSink(surface);
+        }
+        return;
+    }
+    // keep the stream line-aligned, the rest goes out before the next line
+    surface.sinkPendingOffset = 0;
+    surface.sinkPendingLength = size - size_t(sent);
+    memcpy(surface.sinkPending.data(), line + sent, surface.sinkPendingLength);
+}
+
+// Frame capture: copies presented images into a small ring of host visible
+// buffers. The copy is chained in front of the present on the same queue, and
+// a worker thread waits for it and writes the result to disk, so the app never
+// waits on a capture. If every slot is still in flight the frame is dropped.
+static constexpr uint32_t CaptureRingSize = 4;
+static constexpr uint32_t MaxCaptureWaitSemaphores = 16;
+
+struct CaptureConfig {
+    const char *directory = nullptr;
+    uint32_t interval = 1;
+    // 0 means no limit
+    uint32_t frameCount = 1;
+};
+
+static const CaptureConfig &GetCaptureConfig()
+{
+    static const CaptureConfig s_config = [] {
+        CaptureConfig config;
+        config.directory = getenv("HDR_WSI_CAPTURE_DIR");
+        if (const char *interval = getenv("HDR_WSI_CAPTURE_INTERVAL")) {
+            config.interval = std::max(1, atoi(interval));
+        }
+        if (const char *frameCount = getenv("HDR_WSI_CAPTURE_FRAMES")) {
+            config.frameCount = std::max(0, atoi(frameCount));
+        }
+        return config;
+    }();
+    return s_config;
+}
+
+struct CaptureSlot {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    void *mapped = nullptr;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    VkFence fence = VK_NULL_HANDLE;
+
+    // what was presented and how it was tagged, filled in before the slot is
+    // handed to the worker
+    uint64_t frame = 0;
+    VkColorSpaceKHR colorSpace;
+    const ColorDescription *description;
+    VkHdrMetadataEXT metadata;
+
+    std::atomic<bool> busy = false;
+    // owned by the worker while busy
+    std::shared_ptr<CaptureRing> pendingRing;
+    CaptureSlot *nextPending = nullptr;
+};
+
+struct CaptureRing {
+    const vkroots::VkDeviceDispatch *pDispatch;
+    VkDevice device;
+    uint64_t id;
+    VkFormat format;
+    VkExtent2D extent;
+    uint32_t bytesPerPixel;
+    std::vector<VkImage> images;
+    // Signaled by a capture and waited on by the present of the same image.
+    // The fence can't tell when that wait has finished, but the app can only
+    // present the image again after acquiring it, which the presentation
+    // engine only allows once the previous present is done with it.
+    std::vector<VkSemaphore> semaphores;
+
+    // created on the first capture, once the present queue is known
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    uint32_t queueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+
+    std::array<CaptureSlot, CaptureRingSize> slots;
+    uint32_t nextSlot = 0;
+    uint64_t presentCount = 0;
+    uint64_t capturedCount = 0;
+    uint64_t droppedCount = 0;
+};
+
+static uint32_t CaptureBytesPerPixel(VkFormat format)
+{
+    switch (format) {
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+        case VK_FORMAT_R16G16B16A16_UNORM:
+            return 8;
+        case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+        case VK_FORMAT_A2R10G10B10_UNORM_PACK32:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+static void WriteCapture(const CaptureRing &ring, const CaptureSlot &slot)
+{
+    const char *directory = GetCaptureConfig().directory;
+    const uint32_t rowPitch = ring.extent.width * ring.bytesPerPixel;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/hdr_capture_%d_%" PRIu64 "_%06" PRIu64 ".raw", directory, getpid(), ring.id, slot.frame);
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "[HDR Layer] Failed to open capture file %s\n", path);
+        return;
+    }
+    fwrite(slot.mapped, rowPitch, ring.extent.height, file);
+    fclose(file);
+
+    snprintf(path, sizeof(path), "%s/hdr_capture_%d_%" PRIu64 "_%06" PRIu64 ".json", directory, getpid(), ring.id, slot.frame);
+    file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "[HDR Layer] Failed to open capture file %s\n", path);
+        return;
+    }
+    const auto &metadata = slot.metadata;
+    fprintf(file,
+            "{\n"
+            "  \"frame\": %" PRIu64 ",\n"
+            "  \"width\": %u,\n"
+            "  \"height\": %u,\n"
+            "  \"rowPitch\": %u,\n"
+            "  \"format\": \"%s\",\n"
+            "  \"colorSpace\": \"%s\",\n"
+            "  \"tagged\": %s,\n"
+            "  \"primaries\": %u,\n"
+            "  \"transferFunction\": %u,\n"
+            "  \"displayPrimaries\": [[%f, %f], [%f, %f], [%f, %f]],\n"
+            "  \"whitePoint\": [%f, %f],\n"
+            "  \"minLuminance\": %f,\n"
+            "  \"maxLuminance\": %f,\n"
+            "  \"maxContentLightLevel\": %f,\n"
+            "  \"maxFrameAverageLightLevel\": %f\n"
+            "}\n",
+            slot.frame,
+            ring.extent.width,
+            ring.extent.height,
+            rowPitch,
+            vkroots::helpers::enumString(ring.format),
+            vkroots::helpers::enumString(slot.colorSpace),
+            slot.description ? "true" : "false",
+            slot.description ? uint32_t(slot.description->primaries) : 0u,
+            slot.description ? uint32_t(slot.description->transferFunction) : 0u,
+            metadata.displayPrimaryRed.x, metadata.displayPrimaryRed.y,
+            metadata.displayPrimaryGreen.x, metadata.displayPrimaryGreen.y,
+            metadata.displayPrimaryBlue.x, metadata.displayPrimaryBlue.y,
+            metadata.whitePoint.x, metadata.whitePoint.y,
+            metadata.minLuminance,
+            metadata.maxLuminance,
+            metadata.maxContentLightLevel,
+            metadata.maxFrameAverageLightLevel);
+    fclose(file);
+}
+
+class CaptureWorker
+{
+public:
+    ~CaptureWorker()
+    {
+        {
+            std::unique_lock lock(m_mutex);
+            m_quit = true;
+        }
+        m_condition.notify_one();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    void submit(std::shared_ptr<CaptureRing> ring, uint32_t slotIndex)
+    {
+        auto &slot = ring->slots[slotIndex];
+        {
+            std::unique_lock lock(m_mutex);
+            if (!m_thread.joinable()) {
+                m_thread = std::thread([this] { run(); });
+            }
+            // the slot itself is the queue node, so queueing never allocates
+            slot.pendingRing = std::move(ring);
+            slot.nextPending = nullptr;
+            if (m_last) {
+                m_last->nextPending = &slot;
+            } else {
+                m_first = &slot;
+            }
+            m_last = &slot;
+        }
+        m_condition.notify_one();
+    }
+
+private:
+    void run()
+    {
+        while (true) {
+            CaptureSlot *slot;
+            {
+                std::unique_lock lock(m_mutex);
+                m_condition.wait(lock, [this] { return m_quit || m_first; });
+                if (!m_first) {
+                    return;
+                }
+                slot = m_first;
+                m_first = slot->nextPending;
+                if (!m_first) {
+                    m_last = nullptr;
+                }
+            }
+
+            const auto ring = std::move(slot->pendingRing);
+            if (ring->pDispatch->WaitForFences(ring->device, 1, &slot->fence, VK_TRUE, UINT64_MAX) == VK_SUCCESS) {
+                WriteCapture(*ring, *slot);
+            }
+            ring->pDispatch->ResetFences(ring->device, 1, &slot->fence);
+            slot->busy = false;
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    CaptureSlot *m_first = nullptr;
+    CaptureSlot *m_last = nullptr;
+    bool m_quit = false;
+    std::thread m_thread;
+};
+static CaptureWorker s_captureWorker;
+
+static std::optional<uint32_t> FindCaptureMemoryType(const VkPhysicalDeviceMemoryProperties &properties, uint32_t typeBits)
+{
+    constexpr VkMemoryPropertyFlags required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    std::optional<uint32_t> fallback;
+    for (uint32_t i = 0; i < properties.memoryTypeCount; i++) {
+        const VkMemoryPropertyFlags flags = properties.memoryTypes[i].propertyFlags;
+        if (!(typeBits & (1u << i)) || (flags & required) != required) {
+            continue;
+        }
+        // reading back from uncached memory is very slow
+        if (flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) {
+            return i;
+        }
+        if (!fallback) {
+            fallback = i;
+        }
+    }
+    return fallback;
+}
+
+static bool InitCaptureSlot(CaptureRing &ring, CaptureSlot &slot, const VkPhysicalDeviceMemoryProperties &memoryProperties)
+{
+    const auto pDispatch = ring.pDispatch;
+
+    const VkBufferCreateInfo bufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = VkDeviceSize(ring.extent.width) * ring.extent.height * ring.bytesPerPixel,
+        .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    if (pDispatch->CreateBuffer(ring.device, &bufferInfo, nullptr, &slot.buffer) != VK_SUCCESS) {
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    pDispatch->GetBufferMemoryRequirements(ring.device, slot.buffer, &requirements);
+    const auto memoryType = FindCaptureMemoryType(memoryProperties, requirements.memoryTypeBits);
+    if (!memoryType) {
+        return false;
+    }
+    const VkMemoryAllocateInfo allocateInfo = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+        .memoryTypeIndex = *memoryType,
+    };
+    if (pDispatch->AllocateMemory(ring.device, &allocateInfo, nullptr, &slot.memory) != VK_SUCCESS
+        || pDispatch->BindBufferMemory(ring.device, slot.buffer, slot.memory, 0) != VK_SUCCESS
+        || pDispatch->MapMemory(ring.device, slot.memory, 0, VK_WHOLE_SIZE, 0, &slot.mapped) != VK_SUCCESS) {
+        return false;
+    }
+
+    const VkFenceCreateInfo fenceInfo = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    };
+    return pDispatch->CreateFence(ring.device, &fenceInfo, nullptr, &slot.fence) == VK_SUCCESS;
+}
+
+static void DestroyCaptureRing(CaptureRing &ring)
+{
+    const auto pDispatch = ring.pDispatch;
+    for (auto &slot : ring.slots) {
+        while (slot.busy) {
+            std::this_thread::yield();
+        }
+        pDispatch->DestroyFence(ring.device, slot.fence, nullptr);
+        pDispatch->DestroyBuffer(ring.device, slot.buffer, nullptr);
+        pDispatch->FreeMemory(ring.device, slot.memory, nullptr);
+    }
+    for (VkSemaphore semaphore : ring.semaphores) {
+        pDispatch->DestroySemaphore(ring.device, semaphore, nullptr);
+    }
+    pDispatch->DestroyCommandPool(ring.device, ring.commandPool, nullptr);
+
+    fprintf(stderr, "[HDR Layer] Captured %" PRIu64 " frames, dropped %" PRIu64 "\n", ring.capturedCount, ring.droppedCount);
+}
+
+static std::shared_ptr<CaptureRing> CreateCaptureRing(const vkroots::VkDeviceDispatch *pDispatch, VkDevice device, VkSwapchainKHR swapchain, const VkSwapchainCreateInfoKHR &createInfo)
+{
+    static std::atomic<uint64_t> s_nextId = 0;
+
+    auto ring = std::make_shared<CaptureRing>();
+    ring->pDispatch = pDispatch;
+    ring->device = device;
+    ring->id = s_nextId++;
+    ring->format = createInfo.imageFormat;
+    ring->extent = createInfo.imageExtent;
+    ring->bytesPerPixel = CaptureBytesPerPixel(createInfo.imageFormat);
+    vkroots::helpers::enumerate(pDispatch->GetSwapchainImagesKHR, ring->images, device, swapchain);
+
+    const VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+    ring->semaphores.resize(ring->images.size(), VK_NULL_HANDLE);
+    for (auto &semaphore : ring->semaphores) {
+        if (pDispatch->CreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS) {
+            fprintf(stderr, "[HDR Layer] Failed to create capture semaphores, capture disabled\n");
+            DestroyCaptureRing(*ring);
+            return nullptr;
+        }
+    }
+
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    pDispatch->pPhysicalDeviceDispatch->pInstanceDispatch->GetPhysicalDeviceMemoryProperties(pDispatch->PhysicalDevice, &memoryProperties);
+    for (auto &slot : ring->slots) {
+        if (!InitCaptureSlot(*ring, slot, memoryProperties)) {
+            fprintf(stderr, "[HDR Layer] Failed to allocate capture buffers, capture disabled\n");
+            DestroyCaptureRing(*ring);
+            return nullptr;
+        }
+    }
+    return ring;
+}
+
+static bool EnsureCaptureCommandPool(CaptureRing &ring, uint32_t queueFamilyIndex)
+{
+    if (ring.commandPool) {
+        return ring.queueFamilyIndex == queueFamilyIndex;
+    }
+
+    const auto pDispatch = ring.pDispatch;
+    const VkCommandPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        .queueFamilyIndex = queueFamilyIndex,
+    };
+    if (pDispatch->CreateCommandPool(ring.device, &poolInfo, nullptr, &ring.commandPool) != VK_SUCCESS) {
+        return false;
+    }
+    ring.queueFamilyIndex = queueFamilyIndex;
+
+    std::array<VkCommandBuffer, CaptureRingSize> commandBuffers;
+    const VkCommandBufferAllocateInfo allocateInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = ring.commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = CaptureRingSize,
+    };
+    if (pDispatch->AllocateCommandBuffers(ring.device, &allocateInfo, commandBuffers.data()) != VK_SUCCESS) {
+        pDispatch->DestroyCommandPool(ring.device, ring.commandPool, nullptr);
+        ring.commandPool = VK_NULL_HANDLE;
+        return false;
+    }
+    for (uint32_t i = 0; i < CaptureRingSize; i++) {
+        // dispatchable objects created by a layer need the loader's dispatch table
+        *reinterpret_cast<void **>(commandBuffers[i]) = *reinterpret_cast<void **>(ring.device);
+        ring.slots[i].commandBuffer = commandBuffers[i];
+    }
+    return true;
+}
+
+static void RecordCapture(const CaptureRing &ring, const CaptureSlot &slot, VkImage image)
+{
+    const auto pDispatch = ring.pDispatch;
+
+    pDispatch->ResetCommandBuffer(slot.commandBuffer, 0);
+    const VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    pDispatch->BeginCommandBuffer(slot.commandBuffer, &beginInfo);
+
+    // Without wait semaphores on the present, only this barrier orders the copy
+    // after the app's rendering, whichever stage that wrote the image.
+    const VkImageMemoryBarrier toTransfer = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+    };
+    pDispatch->CmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                  0, 0, nullptr, 0, nullptr, 1, &toTransfer);
+
+    const VkBufferImageCopy region = {
+        .bufferOffset = 0,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+        .imageOffset = { 0, 0, 0 },
+        .imageExtent = { ring.extent.width, ring.extent.height, 1 },
+    };
+    pDispatch->CmdCopyImageToBuffer(slot.commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.buffer, 1, &region);
+
+    const VkImageMemoryBarrier toPresent = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .dstAccessMask = 0,
+        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+    };
+    const VkBufferMemoryBarrier toHost = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = slot.buffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+    pDispatch->CmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+                                  0, 0, nullptr, 1, &toHost, 1, &toPresent);
+
+    pDispatch->EndCommandBuffer(slot.commandBuffer);
+}
+
+// Submits a copy of the presented image into the next free slot. The copy
+// waits on what the present would have waited on, and signals a semaphore
+// the present has to wait on instead.
+static bool CaptureFrame(const std::shared_ptr<CaptureRing> &capture, VkQueue queue, uint32_t imageIndex, const HdrSwapchainData &swapchain,
+                         uint32_t waitSemaphoreCount, const VkSemaphore *pWaitSemaphores, VkSemaphore *pSignalSemaphore)
+{
+    auto &ring = *capture;
+    const auto &config = GetCaptureConfig();
+    const uint64_t frame = ring.presentCount++;
+    if (frame % config.interval != 0 || (config.frameCount && ring.capturedCount >= config.frameCount)) {
+        return false;
+    }
+    if (imageIndex >= ring.images.size() || waitSemaphoreCount > MaxCaptureWaitSemaphores) {
+        return false;
+    }
+
+    uint32_t queueFamilyIndex;
+    if (auto hdrQueue = HdrQueue::get(queue)) {
+        queueFamilyIndex = hdrQueue->familyIndex;
+    } else {
+        return false;
+    }
+    if (!EnsureCaptureCommandPool(ring, queueFamilyIndex)) {
+        return false;
+    }
+
+    const uint32_t slotIndex = ring.nextSlot;
+    auto &slot = ring.slots[slotIndex];
+    if (slot.busy) {
+        ring.droppedCount++;
+        return false;
+    }
+    ring.nextSlot = (ring.nextSlot + 1) % CaptureRingSize;
+
+    RecordCapture(ring, slot, ring.images[imageIndex]);
+    slot.frame = frame;
+    slot.colorSpace = swapchain.colorSpace;
+    slot.description = swapchain.sentDescription;
+    slot.metadata = swapchain.sentMetadata;
+
+    std::array<VkPipelineStageFlags, MaxCaptureWaitSemaphores> waitStages;
+    waitStages.fill(VK_PIPELINE_STAGE_TRANSFER_BIT);
+    const VkSubmitInfo submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .waitSemaphoreCount = waitSemaphoreCount,
+        .pWaitSemaphores = pWaitSemaphores,
+        .pWaitDstStageMask = waitStages.data(),
+        .commandBufferCount = 1,
+        .pCommandBuffers = &slot.commandBuffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &ring.semaphores[imageIndex],
+    };
+    if (ring.pDispatch->QueueSubmit(queue, 1, &submitInfo, slot.fence) != VK_SUCCESS) {
+        return false;
+    }
+
+    slot.busy = true;
+    ring.capturedCount++;
+    s_captureWorker.submit(capture, slotIndex);
+    *pSignalSemaphore = ring.semaphores[imageIndex];
+    return true;
+}
+
+class VkDeviceOverrides
+{
+public:
+    static void GetDeviceQueue(
+        const vkroots::VkDeviceDispatch *pDispatch,
+        VkDevice device,
+        uint32_t queueFamilyIndex,
+        uint32_t queueIndex,
+        VkQueue *pQueue)
+    {
+        pDispatch->GetDeviceQueue(device, queueFamilyIndex, queueIndex, pQueue);
+        if (*pQueue) {
+            HdrQueue::create(*pQueue, HdrQueueData{
+                .familyIndex = queueFamilyIndex,
+            });
+            TrackDeviceQueue(device, *pQueue);
+        }
+    }
+
+    static void GetDeviceQueue2(
+        const vkroots::VkDeviceDispatch *pDispatch,
+        VkDevice device,
+        const VkDeviceQueueInfo2 *pQueueInfo,
+        VkQueue *pQueue)
+    {
+        pDispatch->GetDeviceQueue2(device, pQueueInfo, pQueue);
+        if (*pQueue) {
+            HdrQueue::create(*pQueue, HdrQueueData{
+                .familyIndex = pQueueInfo->queueFamilyIndex,
+            });
+            TrackDeviceQueue(device, *pQueue);
+        }
+    }
+
+    static void DestroyDevice(
+        const vkroots::VkDeviceDispatch *pDispatch,
+        VkDevice device,
+        const VkAllocationCallbacks *pAllocator)
+    {
+        if (auto hdrDevice = HdrDevice::get(device)) {
+            for (VkQueue queue : hdrDevice->queues) {
+                HdrQueue::remove(queue);
+            }
+        }
+        HdrDevice::remove(device);
+        pDispatch->DestroyDevice(device, pAllocator);
+    }
+
+    static void DestroySwapchainKHR(
+        const vkroots::VkDeviceDispatch *pDispatch,
+        VkDevice device,
+        VkSwapchainKHR swapchain,
+        const VkAllocationCallbacks *pAllocator)
+    {
+        if (auto hdrSwapchain = HdrSwapchain::get(swapchain)) {
+            for (auto &prepared : hdrSwapchain->prepared) {
+                DestroyPreparedDescription(prepared);
+            }
+            if (hdrSwapchain->capture) {
+                DestroyCaptureRing(*hdrSwapchain->capture);
+            }
+            if (hdrSwapchain->preferredMatches || hdrSwapchain->preferredMismatches) {
+                fprintf(stderr, "[HDR Layer] %" PRIu64 " of %" PRIu64 " presents matched the preferred image description\n",
+                        hdrSwapchain->preferredMatches, hdrSwapchain->preferredMatches + hdrSwapchain->preferredMismatches);
+            }
+        }
+        HdrSwapchain::remove(swapchain);
+
+        std::shared_ptr<OverlaySurface> overlay;
+        if (auto hdrOverlay = HdrOverlay::get(swapchain)) {
+            overlay = std::move(hdrOverlay->overlay);
+        }
+        HdrOverlay::remove(swapchain);
+
+        pDispatch->DestroySwapchainKHR(device, swapchain, pAllocator);
+        // the subsurface goes with the last swapchain presenting to it, retired or not
+        overlay.reset();
+    }
 
     static VkResult CreateSwapchainKHR(
         const vkroots::VkDeviceDispatch *pDispatch,
@@ -554,8 +2127,39 @@ public:
         const VkAllocationCallbacks *pAllocator,
         VkSwapchainKHR *pSwapchain)
     {
+        if (auto overlayInfo = FindLayerStruct<VkSwapchainSdrOverlayCreateInfoHDRWSI>(pCreateInfo->pNext, VK_STRUCTURE_TYPE_SWAPCHAIN_SDR_OVERLAY_CREATE_INFO_HDRWSI)) {
+            return CreateOverlaySwapchain(pDispatch, device, pCreateInfo, *overlayInfo, pAllocator, pSwapchain);
+        }
+
+        // An overlay swapchain's driver swapchain is on the subsurface, so the
+        // driver can't replace it with one on this surface
+        VkSwapchainCreateInfoKHR fromOverlayInfo;
+        if (pCreateInfo->oldSwapchain) {
+            if (auto oldOverlay = HdrOverlay::get(pCreateInfo->oldSwapchain)) {
+                oldOverlay->retired = true;
+                fromOverlayInfo = *pCreateInfo;
+                fromOverlayInfo.oldSwapchain = VK_NULL_HANDLE;
+                pCreateInfo = &fromOverlayInfo;
+            }
+        }
+
+        // sRGB swapchains are still tracked without activating the surface, so a
+        // later present-time retag to HDR can activate it then
+        bool wantsHdr = pCreateInfo->imageColorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+        if (auto colorSpaces = FindLayerStruct<VkSwapchainColorSpacesCreateInfoHDRWSI>(pCreateInfo->pNext, VK_STRUCTURE_TYPE_SWAPCHAIN_COLOR_SPACES_CREATE_INFO_HDRWSI)) {
+            for (uint32_t i = 0; i < colorSpaces->colorSpaceCount; i++) {
+                wantsHdr |= colorSpaces->pColorSpaces[i] != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+            }
+        }
+        if (wantsHdr) {
+            VkInstanceOverrides::ProbeSurface(pCreateInfo->surface);
+        }
+
         auto hdrSurface = HdrSurface::get(pCreateInfo->surface);
-        if (!hdrSurface)
+        if (!hdrSurface || hdrSurface->inactive)
+            return pDispatch->CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
+
+        if (wantsHdr && !VkInstanceOverrides::ActivateSurface(*hdrSurface.get()))
             return pDispatch->CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
 
         VkSwapchainCreateInfoKHR swapchainInfo = *pCreateInfo;
@@ -569,7 +2173,7 @@ public:
             }
 
             fprintf(stderr, "[HDR Layer] Creating swapchain for id: %u - format: %s - colorspace: %s\n",
-                    wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(hdrSurface->surface)),
+                    SurfaceId(*hdrSurface.get()),
                     vkroots::helpers::enumString(pCreateInfo->imageFormat),
                     vkroots::helpers::enumString(pCreateInfo->imageColorSpace));
         }
@@ -577,20 +2181,28 @@ public:
         // Check for VkFormat support and return VK_ERROR_INITIALIZATION_FAILED
         // if that VkFormat is unsupported for the underlying surface.
         {
-            std::vector<VkSurfaceFormatKHR> supportedSurfaceFormats;
-            vkroots::helpers::enumerate(
-                pDispatch->pPhysicalDeviceDispatch->pInstanceDispatch->GetPhysicalDeviceSurfaceFormatsKHR,
-                supportedSurfaceFormats,
-                pDispatch->PhysicalDevice,
-                swapchainInfo.surface);
+            // the surface's scratch vector, recreating swapchains on resize shouldn't allocate
+            auto &supportedSurfaceFormats = hdrSurface->driverFormats;
+            const auto GetPhysicalDeviceSurfaceFormatsKHR = pDispatch->pPhysicalDeviceDispatch->pInstanceDispatch->GetPhysicalDeviceSurfaceFormatsKHR;
+            uint32_t count = 0;
+            GetPhysicalDeviceSurfaceFormatsKHR(pDispatch->PhysicalDevice, swapchainInfo.surface, &count, nullptr);
+            supportedSurfaceFormats.resize(count);
+            GetPhysicalDeviceSurfaceFormatsKHR(pDispatch->PhysicalDevice, swapchainInfo.surface, &count, supportedSurfaceFormats.data());
+            supportedSurfaceFormats.resize(count);
 
             bool supportedSwapchainFormat = std::ranges::find_if(supportedSurfaceFormats, [=](VkSurfaceFormatKHR value) {
                 return value.format == swapchainInfo.imageFormat;
             }) != supportedSurfaceFormats.end();
+            if (hdrSurface->headless) {
+                supportedSwapchainFormat |= std::ranges::any_of(s_ExtraHDRSurfaceFormats, [&](const ColorDescription &description) {
+                    return description.surface.surfaceFormat.format == swapchainInfo.imageFormat
+                        && HeadlessSupportsFormat(pDispatch->pPhysicalDeviceDispatch->pInstanceDispatch, pDispatch->PhysicalDevice, description);
+                });
+            }
 
             if (!supportedSwapchainFormat) {
                 fprintf(stderr, "[HDR Layer] Refusing to make swapchain (unsupported VkFormat) for id: %u - format: %s - colorspace: %s\n",
-                        wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(hdrSurface->surface)),
+                        SurfaceId(*hdrSurface.get()),
                         vkroots::helpers::enumString(pCreateInfo->imageFormat),
                         vkroots::helpers::enumString(pCreateInfo->imageColorSpace));
 
@@ -598,75 +2210,54 @@ public:
             }
         }
 
+        bool capture = GetCaptureConfig().directory && CaptureBytesPerPixel(pCreateInfo->imageFormat);
+        if (capture) {
+            VkSurfaceCapabilitiesKHR capabilities;
+            pDispatch->pPhysicalDeviceDispatch->pInstanceDispatch->GetPhysicalDeviceSurfaceCapabilitiesKHR(pDispatch->PhysicalDevice, swapchainInfo.surface, &capabilities);
+            if (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) {
+                swapchainInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+            } else {
+                fprintf(stderr, "[HDR Layer] Surface doesn't support transfer source usage, capture disabled\n");
+                capture = false;
+            }
+        }
+
         VkResult result = pDispatch->CreateSwapchainKHR(device, &swapchainInfo, pAllocator, pSwapchain);
         if (hdrSurface && result == VK_SUCCESS) {
-            if (hdrSurface->frogColorSurface) {
-                // alpha mode is ignored
-                frog_color_managed_surface_primaries frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED;
-                frog_color_managed_surface_transfer_function tf = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED;
-                for (auto desc = s_ExtraHDRSurfaceFormats.begin(); desc != s_ExtraHDRSurfaceFormats.end(); ++desc) {
-                    if (desc->surface.surfaceFormat.colorSpace == pCreateInfo->imageColorSpace) {
-                        frogPrimaries = desc->frogPrimaries;
-                        tf = desc->frogTransferFunction;
-                        break;
-                    }
-                }
-
-                if (frogPrimaries == 0 && tf == 0 && pCreateInfo->imageColorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-                    fprintf(stderr, "[HDR Layer] Unknown color space, assuming untagged\n");
-                };
+            // alpha mode is ignored
+            const ColorDescription *description = FindColorDescription(pCreateInfo->imageColorSpace);
+            if (!description && pCreateInfo->imageColorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+                fprintf(stderr, "[HDR Layer] Unknown colorspace %d, assuming untagged\n", pCreateInfo->imageColorSpace);
+            } else if (description && !SurfaceSupportsDescription(*hdrSurface.get(), *description)) {
+                fprintf(stderr, "[HDR Layer] Colorspace %s isn't supported by the compositor, assuming untagged\n",
+                        vkroots::helpers::enumString(pCreateInfo->imageColorSpace));
+                description = nullptr;
+            }
 
-                HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                    .surface = pCreateInfo->surface,
-                    .frogPrimaries = frogPrimaries,
-                    .tf = tf,
-                    .desc_dirty = true,
-                });
-            } else if (hdrSurface->colorSurface) {
-                const auto it = std::ranges::find_if(s_ExtraHDRSurfaceFormats, [&pCreateInfo](const ColorDescription &description) {
-                    return description.surface.surfaceFormat.colorSpace == pCreateInfo->imageColorSpace;
-                });
-                if (it != s_ExtraHDRSurfaceFormats.end()) {
-                    const auto &description = *it;
-                    HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                        .surface = pCreateInfo->surface,
-                        .primaries = description.primaries,
-                        .transferFunction = description.transferFunction,
-                        .desc_dirty = true,
-                    });
-                } else {
-                    if (pCreateInfo->imageColorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-                        fprintf(stderr, "[HDR Layer] Unknown colorspace %d, assuming untagged\n", pCreateInfo->imageColorSpace);
+            uint32_t prepareMask = 0;
+            if (auto colorSpaces = FindLayerStruct<VkSwapchainColorSpacesCreateInfoHDRWSI>(pCreateInfo->pNext, VK_STRUCTURE_TYPE_SWAPCHAIN_COLOR_SPACES_CREATE_INFO_HDRWSI)) {
+                for (uint32_t i = 0; i < colorSpaces->colorSpaceCount; i++) {
+                    auto prepared = FindColorDescription(colorSpaces->pColorSpaces[i]);
+                    if (prepared && !SurfaceSupportsDescription(*hdrSurface.get(), *prepared)) {
+                        fprintf(stderr, "[HDR Layer] Not preparing colorspace %s, the compositor doesn't support it\n",
+                                vkroots::helpers::enumString(colorSpaces->pColorSpaces[i]));
+                    } else if (prepared) {
+                        prepareMask |= 1u << (prepared - s_ExtraHDRSurfaceFormats.data());
                     }
-                    HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                        .surface = pCreateInfo->surface,
-                        .untagged = true,
-                        .desc_dirty = true,
-                    });
-                }
-            } else {
-                const auto it = std::ranges::find_if(s_ExtraHDRSurfaceFormats, [&pCreateInfo](const ColorDescription &description) {
-                    return description.surface.surfaceFormat.colorSpace == pCreateInfo->imageColorSpace;
-                });
-                if (it != s_ExtraHDRSurfaceFormats.end()) {
-                    const auto &description = *it;
-                    HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                        .surface = pCreateInfo->surface,
-                        .xxPrimaries = description.xxPrimaries,
-                        .xxTransferFunction = description.xxTransferFunction,
-                        .desc_dirty = true,
-                    });
-                } else {
-                    if (pCreateInfo->imageColorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-                        fprintf(stderr, "[HDR Layer] Unknown colorspace %d, assuming untagged\n", pCreateInfo->imageColorSpace);
-                    }
-                    HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                        .surface = pCreateInfo->surface,
-                        .xxUntagged = true,
-                        .desc_dirty = true,
-                    });
                 }
             }
+
+            HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
+                .surface = pCreateInfo->surface,
+                .format = pCreateInfo->imageFormat,
+                .colorSpace = pCreateInfo->imageColorSpace,
+                .description = description,
+                .representation = ResolveColorRepresentation(*hdrSurface.get(), *pCreateInfo),
+                .prepared = std::vector<PreparedDescription>(s_ExtraHDRSurfaceFormats.size()),
+                .prepareMask = prepareMask,
+                .desc_dirty = true,
+                .capture = capture ? CreateCaptureRing(pDispatch, device, *pSwapchain, swapchainInfo) : nullptr,
+            });
         }
         return result;
     }
@@ -693,12 +2284,17 @@ public:
             }
 
             const VkHdrMetadataEXT &metadata = pMetadata[i];
+            if (SameHdrMetadata(hdrSwapchain->metadata, metadata)) {
+                // many apps set the same metadata every frame, don't re-tag for it
+                continue;
+            }
 
             fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: mastering luminance min %f nits, max %f nits\n", metadata.minLuminance, metadata.maxLuminance);
             fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: maxContentLightLevel %f nits\n", metadata.maxContentLightLevel);
             fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: maxFrameAverageLightLevel %f nits\n", metadata.maxFrameAverageLightLevel);
 
             hdrSwapchain->metadata = metadata;
+            hdrSwapchain->metadataSerial++;
             hdrSwapchain->desc_dirty = true;
         }
     }
@@ -708,14 +2304,63 @@ public:
         VkQueue queue,
         const VkPresentInfoKHR *pPresentInfo)
     {
+        const auto colorSpaceInfo = FindLayerStruct<VkPresentColorSpaceInfoHDRWSI>(pPresentInfo->pNext, VK_STRUCTURE_TYPE_PRESENT_COLOR_SPACE_INFO_HDRWSI);
+        VkSemaphore captureSemaphore = VK_NULL_HANDLE;
+
+        // A retag to HDR may have to probe the surface first, which waits on the
+        // compositor and so has to happen before the surface locks are taken below
+        if (colorSpaceInfo) {
+            for (uint32_t i = 0; i < std::min(pPresentInfo->swapchainCount, colorSpaceInfo->swapchainCount); i++) {
+                const VkColorSpaceKHR colorSpace = colorSpaceInfo->pColorSpaces[i];
+                VkSurfaceKHR surface = VK_NULL_HANDLE;
+                if (auto hdrSwapchain = HdrSwapchain::get(pPresentInfo->pSwapchains[i]); hdrSwapchain && colorSpace != hdrSwapchain->colorSpace) {
+                    surface = hdrSwapchain->surface;
+                }
+                if (surface && colorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+                    VkInstanceOverrides::ProbeSurface(surface);
+                }
+            }
+        }
+
         for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++) {
             if (auto hdrSwapchain = HdrSwapchain::get(pPresentInfo->pSwapchains[i])) {
+                auto hdrSurface = HdrSurface::get(hdrSwapchain->surface);
+                if (colorSpaceInfo && i < colorSpaceInfo->swapchainCount && colorSpaceInfo->pColorSpaces[i] != hdrSwapchain->colorSpace) {
+                    const VkColorSpaceKHR colorSpace = colorSpaceInfo->pColorSpaces[i];
+                    if (colorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR && !VkInstanceOverrides::ActivateSurface(*hdrSurface.get())) {
+                        fprintf(stderr, "[HDR Layer] Ignoring retag to colorspace %s, the compositor can't tag this surface\n",
+                                vkroots::helpers::enumString(colorSpace));
+                    } else {
+                        RetagSwapchain(*hdrSurface.get(), *hdrSwapchain.get(), colorSpace);
+                    }
+                }
+                if (hdrSurface->feedback) {
+                    wl_display_dispatch_queue_pending(hdrSurface->display, hdrSurface->queue);
+                    if (hdrSurface->preferredChanged) {
+                        UpdatePreferredDescription(*hdrSurface.get());
+                    }
+                    if (hdrSwapchain->preferredSerial != hdrSurface->preferredSerial) {
+                        hdrSwapchain->preferredSerial = hdrSurface->preferredSerial;
+                        hdrSwapchain->desc_dirty = true;
+                    }
+                }
                 if (hdrSwapchain->desc_dirty) {
-                    auto hdrSurface = HdrSurface::get(hdrSwapchain->surface);
                     const auto &metadata = hdrSwapchain->metadata;
-                    if (hdrSurface->frogColorSurface) {
-                        frog_color_managed_surface_set_known_container_color_volume(hdrSurface->frogColorSurface, hdrSwapchain->frogPrimaries);
-                        frog_color_managed_surface_set_known_transfer_function(hdrSurface->frogColorSurface, hdrSwapchain->tf);
+                    const ColorDescription *description = hdrSwapchain->description;
+                    hdrSwapchain->sentDescription = description;
+                    hdrSwapchain->sentMetadata = description ? metadata : VkHdrMetadataEXT{};
+                    if (hdrSurface->headless) {
+                        // nothing to tell a compositor, the sink sees every present below
+                    } else if (!hdrSurface->activated) {
+                        // surfaces stay untouched until something asks for HDR
+                        hdrSwapchain->sentDescription = nullptr;
+                        hdrSwapchain->sentMetadata = {};
+                    } else if (hdrSurface->frogColorSurface) {
+                        hdrSwapchain->sentMetadata = metadata;
+                        frog_color_managed_surface_set_known_container_color_volume(hdrSurface->frogColorSurface,
+                                                                                    description ? description->frogPrimaries : FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED);
+                        frog_color_managed_surface_set_known_transfer_function(hdrSurface->frogColorSurface,
+                                                                               description ? description->frogTransferFunction : FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED);
                         frog_color_managed_surface_set_hdr_metadata(hdrSurface->frogColorSurface,
                                                                     uint32_t(round(metadata.displayPrimaryRed.x * 10000.0)),
                                                                     uint32_t(round(metadata.displayPrimaryRed.y * 10000.0)),
@@ -729,92 +2374,298 @@ public:
                                                                     uint32_t(round(metadata.minLuminance * 10000.0)),
                                                                     uint32_t(round(metadata.maxContentLightLevel)),
                                                                     uint32_t(round(metadata.maxFrameAverageLightLevel)));
-                    } else if (hdrSurface->colorSurface) {
-                        if (hdrSwapchain->untagged) {
-                            wp_color_management_surface_v1_unset_image_description(hdrSurface->colorSurface);
-                        } else {
-                            constexpr double primaryUnit = 1'000'000.0;
-                            const auto creator = wp_color_manager_v1_create_parametric_creator(hdrSurface->colorManager);
-                            wp_image_description_creator_params_v1_set_primaries_named(creator, hdrSwapchain->primaries);
-                            wp_image_description_creator_params_v1_set_tf_named(creator, hdrSwapchain->transferFunction);
-                            wp_image_description_creator_params_v1_set_max_fall(creator, std::round(metadata.maxFrameAverageLightLevel));
-                            wp_image_description_creator_params_v1_set_max_cll(creator, std::round(metadata.maxContentLightLevel));
-                            const bool hasMasteringPrimaries = std::ranges::find(hdrSurface->supportedFeatures, WP_COLOR_MANAGER_V1_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES) != hdrSurface->supportedFeatures.end();
-                            if (hasMasteringPrimaries) {
-                                wp_image_description_creator_params_v1_set_mastering_luminance(creator, std::round(metadata.minLuminance * 10'000.0), std::round(metadata.maxLuminance));
-                                wp_image_description_creator_params_v1_set_mastering_display_primaries(creator,
-                                                                                                       std::round(metadata.displayPrimaryRed.x * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryRed.y * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryGreen.x * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryGreen.y * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryBlue.x * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryBlue.y * primaryUnit),
-                                                                                                       std::round(metadata.whitePoint.x * primaryUnit),
-                                                                                                       std::round(metadata.whitePoint.y * primaryUnit));
-                            }
-                            const bool hasCustomLuminance = std::ranges::find(hdrSurface->supportedFeatures, WP_COLOR_MANAGER_V1_FEATURE_SET_LUMINANCES) != hdrSurface->supportedFeatures.end();
-                            if (hasCustomLuminance && hdrSwapchain->transferFunction == WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR) {
-                                // NOTE that this assumes that this is Windows-style scRGB
-                                wp_image_description_creator_params_v1_set_luminances(creator, 0, 80, 203);
+                    } else {
+                        PrepareImageDescriptions(*hdrSurface.get(), *hdrSwapchain.get());
+                        if (hdrSurface->colorSurface) {
+                            if (!description) {
+                                wp_color_management_surface_v1_unset_image_description(hdrSurface->colorSurface);
+                            } else {
+                                const auto &prepared = hdrSwapchain->prepared[description - s_ExtraHDRSurfaceFormats.data()];
+                                wp_color_management_surface_v1_set_image_description(hdrSurface->colorSurface, prepared.description, WP_COLOR_MANAGER_V1_RENDER_INTENT_PERCEPTUAL);
+                                hdrSwapchain->sentMetadata = prepared.sentMetadata;
                             }
-                            const auto imageDescription = wp_image_description_creator_params_v1_create(creator);
-
-                            bool done = false;
-                            wp_image_description_v1_add_listener(imageDescription, &s_imageDescriptionListener, &done);
-                            wl_display_dispatch_queue(hdrSurface->display, hdrSurface->queue);
-                            // In theory the compositor could wait for a while here. In practice it doesn't.
-                            while (!done) {
-                                wl_display_roundtrip_queue(hdrSurface->display, hdrSurface->queue);
+                            const bool matchesPreferred = description && hdrSwapchain->prepared[description - s_ExtraHDRSurfaceFormats.data()].matchesPreferred;
+                            if (hdrSurface->feedback && matchesPreferred != hdrSwapchain->matchedPreferred) {
+                                fprintf(stderr, "[HDR Layer] Tag %s the preferred image description\n", matchesPreferred ? "now matches" : "no longer matches");
                             }
-                            wp_color_management_surface_v1_set_image_description(hdrSurface->colorSurface, imageDescription, WP_COLOR_MANAGER_V1_RENDER_INTENT_PERCEPTUAL);
-                            wp_image_description_v1_destroy(imageDescription);
-                        }
-                    } else if (hdrSwapchain->xxUntagged) {
-                        xx_color_management_surface_v4_unset_image_description(hdrSurface->xxColorSurface);
-                    } else {
-                        const auto creator = xx_color_manager_v4_new_parametric_creator(hdrSurface->xxColorManager);
-                        xx_image_description_creator_params_v4_set_primaries_named(creator, hdrSwapchain->xxPrimaries);
-                        xx_image_description_creator_params_v4_set_tf_named(creator, hdrSwapchain->xxTransferFunction);
-                        xx_image_description_creator_params_v4_set_max_fall(creator, std::round(metadata.maxFrameAverageLightLevel));
-                        xx_image_description_creator_params_v4_set_max_cll(creator, std::round(metadata.maxContentLightLevel));
-                        const bool hasMasteringPrimaries = std::ranges::find(hdrSurface->xxSupportedFeatures, XX_COLOR_MANAGER_V4_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES) != hdrSurface->xxSupportedFeatures.end();
-                        if (hasMasteringPrimaries) {
-                            xx_image_description_creator_params_v4_set_mastering_luminance(creator, std::round(metadata.minLuminance * 10'000.0), std::round(metadata.maxLuminance));
-                            xx_image_description_creator_params_v4_set_mastering_display_primaries(creator,
-                                std::round(metadata.displayPrimaryRed.x * 10000.0),
-                                std::round(metadata.displayPrimaryRed.y * 10000.0),
-                                std::round(metadata.displayPrimaryGreen.x * 10000.0),
-                                std::round(metadata.displayPrimaryGreen.y * 10000.0),
-                                std::round(metadata.displayPrimaryBlue.x * 10000.0),
-                                std::round(metadata.displayPrimaryBlue.y * 10000.0),
-                                std::round(metadata.whitePoint.x * 10000.0),
-                                std::round(metadata.whitePoint.y * 10000.0)
-                            );
-                        }
-                        const bool hasCustomLuminance = std::ranges::find(hdrSurface->xxSupportedFeatures, XX_COLOR_MANAGER_V4_FEATURE_SET_LUMINANCES) != hdrSurface->xxSupportedFeatures.end();
-                        if (hasCustomLuminance && hdrSwapchain->xxTransferFunction == XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR) {
-                            // NOTE that this assumes that this is Windows-style scRGB
-                            xx_image_description_creator_params_v4_set_luminances(creator, 0, 80, 203);
+                            hdrSwapchain->matchedPreferred = matchesPreferred;
+                        } else if (!description) {
+                            xx_color_management_surface_v4_unset_image_description(hdrSurface->xxColorSurface);
+                        } else {
+                            const auto &prepared = hdrSwapchain->prepared[description - s_ExtraHDRSurfaceFormats.data()];
+                            xx_color_management_surface_v4_set_image_description(hdrSurface->xxColorSurface, prepared.xxDescription, XX_COLOR_MANAGER_V4_RENDER_INTENT_PERCEPTUAL);
+                            hdrSwapchain->sentMetadata = prepared.sentMetadata;
                         }
-                        const auto imageDescription = xx_image_description_creator_params_v4_create(creator);
-
-                        bool done = false;
-                        xx_image_description_v4_add_listener(imageDescription, &s_xxImageDescriptionListener, &done);
-                        wl_display_dispatch_queue(hdrSurface->display, hdrSurface->queue);
-                        // In theory the compositor could wait for a while here. In practice it doesn't.
-                        while (!done) {
-                            wl_display_roundtrip_queue(hdrSurface->display, hdrSurface->queue);
+                    }
+                    if (hdrSurface->headless || !hdrSurface->activated) {
+                        // YCbCr swapchains always activate the surface, nothing to represent
+                    } else if (hdrSwapchain->representation) {
+                        const auto &representation = *hdrSwapchain->representation;
+                        if (!hdrSurface->colorRepresentationSurface) {
+                            hdrSurface->colorRepresentationSurface = wp_color_representation_manager_v1_get_surface(hdrSurface->colorRepresentationManager, hdrSurface->surface);
                         }
-                        xx_color_management_surface_v4_set_image_description(hdrSurface->xxColorSurface, imageDescription, XX_COLOR_MANAGER_V4_RENDER_INTENT_PERCEPTUAL);
-                        xx_image_description_v4_destroy(imageDescription);
+                        wp_color_representation_surface_v1_set_coefficients_and_range(hdrSurface->colorRepresentationSurface, representation.coefficients, representation.range);
+                        wp_color_representation_surface_v1_set_chroma_location(hdrSurface->colorRepresentationSurface, representation.chromaLocation);
+                    } else if (hdrSurface->colorRepresentationSurface) {
+                        // there is no request to unset it, only destroying the object does
+                        wp_color_representation_surface_v1_destroy(hdrSurface->colorRepresentationSurface);
+                        hdrSurface->colorRepresentationSurface = nullptr;
                     }
                     hdrSwapchain->desc_dirty = false;
                 }
+                if (hdrSurface->feedback) {
+                    if (hdrSwapchain->matchedPreferred) {
+                        hdrSwapchain->preferredMatches++;
+                    } else {
+                        hdrSwapchain->preferredMismatches++;
+                    }
+                }
+                if (hdrSurface->headless) {
+                    WriteHeadlessPresent(*hdrSurface.get(), *hdrSwapchain.get(), pPresentInfo->pImageIndices[i]);
+                }
+                hdrSwapchain->presentCount++;
+                if (hdrSwapchain->capture) {
+                    const bool chained = captureSemaphore != VK_NULL_HANDLE;
+                    CaptureFrame(hdrSwapchain->capture, queue, pPresentInfo->pImageIndices[i], *hdrSwapchain.get(),
+                                 chained ? 1 : pPresentInfo->waitSemaphoreCount,
+                                 chained ? &captureSemaphore : pPresentInfo->pWaitSemaphores,
+                                 &captureSemaphore);
+                }
             }
         }
 
+        if (captureSemaphore) {
+            VkPresentInfoKHR presentInfo = *pPresentInfo;
+            presentInfo.waitSemaphoreCount = 1;
+            presentInfo.pWaitSemaphores = &captureSemaphore;
+            return pDispatch->QueuePresentKHR(queue, &presentInfo);
+        }
         return pDispatch->QueuePresentKHR(queue, pPresentInfo);
     }
+
+private:
+    static void TrackDeviceQueue(VkDevice device, VkQueue queue)
+    {
+        if (auto hdrDevice = HdrDevice::get(device)) {
+            if (std::ranges::find(hdrDevice->queues, queue) == hdrDevice->queues.end()) {
+                hdrDevice->queues.push_back(queue);
+            }
+        }
+    }
+
+    static constexpr wp_image_description_v1_listener s_overlayDescriptionListener {
+        .failed = [](void *userData, wp_image_description_v1 *descr, uint32_t cause, const char *reason) {
+            fprintf(stderr, "[HDR Layer] creating overlay image description failed! %s\n", reason);
+            *reinterpret_cast<DescStatus *>(userData) = FAILED;
+        },
+        .ready = [](void *userData, wp_image_description_v1 *descr, uint32_t id) {
+            *reinterpret_cast<DescStatus *>(userData) = READY;
+        },
+    };
+
+    static constexpr xx_image_description_v4_listener s_xxOverlayDescriptionListener {
+        .failed = [](void *userData, xx_image_description_v4 *descr, uint32_t cause, const char *reason) {
+            fprintf(stderr, "[HDR Layer] creating overlay image description failed! %s\n", reason);
+            *reinterpret_cast<DescStatus *>(userData) = FAILED;
+        },
+        .ready = [](void *userData, xx_image_description_v4 *descr, uint32_t id) {
+            *reinterpret_cast<DescStatus *>(userData) = READY;
+        },
+    };
+
+    static void WaitForDescription(const HdrSurfaceData &parent, const DescStatus &status)
+    {
+        wl_display_dispatch_queue(parent.display, parent.queue);
+        while (status == WAITING) {
+            wl_display_roundtrip_queue(parent.display, parent.queue);
+        }
+    }
+
+    // sRGB with gamma 2.2, which is what SDR content is made for. referenceWhite
+    // moves (1, 1, 1) relative to the HDR content on the parent surface.
+    static void TagOverlay(const HdrSurfaceData &parent, OverlaySurface &overlay, float referenceWhite)
+    {
+        const uint32_t white = uint32_t(std::round(referenceWhite));
+        if (UsesColorManagement(parent)) {
+            if (!parent.supportedFeatures.contains(WP_COLOR_MANAGER_V1_FEATURE_PARAMETRIC)) {
+                fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for parametric image descriptions, leaving overlay untagged\n");
+                return;
+            }
+            if (!parent.supportedPrimaries.contains(WP_COLOR_MANAGER_V1_PRIMARIES_SRGB)
+                || !parent.supportedTransferFunctions.contains(WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_GAMMA22)) {
+                fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for sRGB primaries with gamma 2.2, leaving overlay untagged\n");
+                return;
+            }
+            overlay.colorSurface = wp_color_manager_v1_get_surface(parent.colorManager, overlay.surface);
+            const auto creator = wp_color_manager_v1_create_parametric_creator(parent.colorManager);
+            wp_image_description_creator_params_v1_set_primaries_named(creator, WP_COLOR_MANAGER_V1_PRIMARIES_SRGB);
+            wp_image_description_creator_params_v1_set_tf_named(creator, WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_GAMMA22);
+            if (white && parent.supportedFeatures.contains(WP_COLOR_MANAGER_V1_FEATURE_SET_LUMINANCES)) {
+                // 0.2 cd/m² is the minimum luminance the protocol assumes for gamma 2.2
+                wp_image_description_creator_params_v1_set_luminances(creator, 2000, white, white);
+            }
+            DescStatus status = WAITING;
+            const auto description = wp_image_description_creator_params_v1_create(creator);
+            wp_image_description_v1_add_listener(description, &s_overlayDescriptionListener, &status);
+            WaitForDescription(parent, status);
+            if (status == READY) {
+                // applied with the overlay's first present
+                wp_color_management_surface_v1_set_image_description(overlay.colorSurface, description, WP_COLOR_MANAGER_V1_RENDER_INTENT_PERCEPTUAL);
+            }
+            wp_image_description_v1_destroy(description);
+        } else if (UsesXxColorManagement(parent)) {
+            if (!parent.xxSupportedFeatures.contains(XX_COLOR_MANAGER_V4_FEATURE_PARAMETRIC)) {
+                fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for parametric image descriptions, leaving overlay untagged\n");
+                return;
+            }
+            if (!parent.xxSupportedPrimaries.contains(XX_COLOR_MANAGER_V4_PRIMARIES_SRGB)
+                || !parent.xxSupportedTransferFunctions.contains(XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_GAMMA22)) {
+                fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for sRGB primaries with gamma 2.2, leaving overlay untagged\n");
+                return;
+            }
+            overlay.xxColorSurface = xx_color_manager_v4_get_surface(parent.xxColorManager, overlay.surface);
+            const auto creator = xx_color_manager_v4_new_parametric_creator(parent.xxColorManager);
+            xx_image_description_creator_params_v4_set_primaries_named(creator, XX_COLOR_MANAGER_V4_PRIMARIES_SRGB);
+            xx_image_description_creator_params_v4_set_tf_named(creator, XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_GAMMA22);
+            if (white && parent.xxSupportedFeatures.contains(XX_COLOR_MANAGER_V4_FEATURE_SET_LUMINANCES)) {
+                xx_image_description_creator_params_v4_set_luminances(creator, 2000, white, white);
+            }
+            DescStatus status = WAITING;
+            const auto description = xx_image_description_creator_params_v4_create(creator);
+            xx_image_description_v4_add_listener(description, &s_xxOverlayDescriptionListener, &status);
+            WaitForDescription(parent, status);
+            if (status == READY) {
+                xx_color_management_surface_v4_set_image_description(overlay.xxColorSurface, description, XX_COLOR_MANAGER_V4_RENDER_INTENT_PERCEPTUAL);
+            }
+            xx_image_description_v4_destroy(description);
+        } else {
+            // frog can only tag whole surfaces without a reference white, untagged is sRGB already
+            fprintf(stderr, "[HDR Layer] Overlay reference white needs color-management-v1 or xx-color-management-v4, leaving it untagged\n");
+        }
+    }
+
+    static bool InitOverlay(const vkroots::VkInstanceDispatch *pInstanceDispatch, HdrSurfaceData &parent, bool canTag, float referenceWhite,
+                            const VkAllocationCallbacks *pAllocator, OverlaySurface &overlay)
+    {
+        overlay.instance = parent.instance;
+        overlay.surface = wl_compositor_create_surface(parent.compositor);
+        overlay.subsurface = wl_subcompositor_get_subsurface(parent.subcompositor, overlay.surface, parent.surface);
+        // the UI is presented at its own rate, not in lockstep with the parent
+        wl_subsurface_set_desync(overlay.subsurface);
+        wl_region *inputRegion = wl_compositor_create_region(parent.compositor);
+        wl_surface_set_input_region(overlay.surface, inputRegion);
+        wl_region_destroy(inputRegion);
+
+        const VkWaylandSurfaceCreateInfoKHR surfaceInfo = {
+            .sType = VK_STRUCTURE_TYPE_WAYLAND_SURFACE_CREATE_INFO_KHR,
+            .display = parent.display,
+            .surface = overlay.surface,
+        };
+        if (pInstanceDispatch->CreateWaylandSurfaceKHR(parent.instance, &surfaceInfo, pAllocator, &overlay.vkSurface) != VK_SUCCESS) {
+            wl_subsurface_destroy(overlay.subsurface);
+            wl_surface_destroy(overlay.surface);
+            return false;
+        }
+
+        if (canTag) {
+            TagOverlay(parent, overlay, referenceWhite);
+        } else {
+            fprintf(stderr, "[HDR Layer] wayland compositor can't tag surfaces, leaving overlay untagged\n");
+        }
+        wl_display_flush(parent.display);
+        return true;
+    }
+
+    static void DestroyOverlay(const vkroots::VkInstanceDispatch *pInstanceDispatch, OverlaySurface &overlay, const VkAllocationCallbacks *pAllocator)
+    {
+        pInstanceDispatch->DestroySurfaceKHR(overlay.instance, overlay.vkSurface, pAllocator);
+        if (overlay.colorSurface) {
+            wp_color_management_surface_v1_destroy(overlay.colorSurface);
+        }
+        if (overlay.xxColorSurface) {
+            xx_color_management_surface_v4_destroy(overlay.xxColorSurface);
+        }
+        wl_subsurface_destroy(overlay.subsurface);
+        wl_surface_destroy(overlay.surface);
+    }
+
+    // Destroys the overlay once the last swapchain sharing it drops it, which
+    // each does only after its driver swapchain is gone.
+    static std::shared_ptr<OverlaySurface> ShareOverlay(const vkroots::VkInstanceDispatch *pInstanceDispatch, const OverlaySurface &overlay,
+                                                        const VkAllocationCallbacks *pAllocator)
+    {
+        // the callbacks only have to stay compatible, not alive
+        std::optional<VkAllocationCallbacks> allocator;
+        if (pAllocator) {
+            allocator = *pAllocator;
+        }
+        return std::shared_ptr<OverlaySurface>(new OverlaySurface(overlay), [pInstanceDispatch, allocator](OverlaySurface *overlay) {
+            DestroyOverlay(pInstanceDispatch, *overlay, allocator ? &*allocator : nullptr);
+            delete overlay;
+        });
+    }
+
+    static VkResult CreateOverlaySwapchain(
+        const vkroots::VkDeviceDispatch *pDispatch,
+        VkDevice device,
+        const VkSwapchainCreateInfoKHR *pCreateInfo,
+        const VkSwapchainSdrOverlayCreateInfoHDRWSI &overlayInfo,
+        const VkAllocationCallbacks *pAllocator,
+        VkSwapchainKHR *pSwapchain)
+    {
+        const auto pInstanceDispatch = pDispatch->pPhysicalDeviceDispatch->pInstanceDispatch;
+
+        std::shared_ptr<OverlaySurface> overlay;
+        if (pCreateInfo->oldSwapchain) {
+            if (auto oldOverlay = HdrOverlay::get(pCreateInfo->oldSwapchain); oldOverlay && !oldOverlay->retired) {
+                overlay = oldOverlay->overlay;
+            }
+        }
+        const bool reused = bool(overlay);
+
+        if (!reused) {
+            // tagging needs color management, the subsurface itself doesn't
+            const bool canTag = VkInstanceOverrides::ProbeSurface(pCreateInfo->surface);
+            auto hdrSurface = HdrSurface::get(pCreateInfo->surface);
+            if (!hdrSurface || hdrSurface->headless) {
+                fprintf(stderr, "[HDR Layer] Refusing to make SDR overlay swapchain, not a Wayland surface\n");
+                return VK_ERROR_INITIALIZATION_FAILED;
+            }
+            if (!hdrSurface->compositor || !hdrSurface->subcompositor) {
+                fprintf(stderr, "[HDR Layer] Refusing to make SDR overlay swapchain, wayland compositor is lacking wl_subcompositor\n");
+                return VK_ERROR_INITIALIZATION_FAILED;
+            }
+            OverlaySurface created = {};
+            if (!InitOverlay(pInstanceDispatch, *hdrSurface.get(), canTag, overlayInfo.referenceWhiteNits, pAllocator, created)) {
+                return VK_ERROR_INITIALIZATION_FAILED;
+            }
+            overlay = ShareOverlay(pInstanceDispatch, created, pAllocator);
+            fprintf(stderr, "[HDR Layer] Created SDR overlay for id: %u - reference white: %f nits\n",
+                    SurfaceId(*hdrSurface.get()), overlayInfo.referenceWhiteNits);
+        }
+
+        VkSwapchainCreateInfoKHR swapchainInfo = *pCreateInfo;
+        swapchainInfo.surface = overlay->vkSurface;
+        // any other old swapchain is on a different surface than the one the driver sees
+        if (!reused) {
+            swapchainInfo.oldSwapchain = VK_NULL_HANDLE;
+        }
+        VkResult result = pDispatch->CreateSwapchainKHR(device, &swapchainInfo, pAllocator, pSwapchain);
+        if (result != VK_SUCCESS) {
+            // destroys a new overlay again, a reused one stays with the old swapchain
+            return result;
+        }
+
+        if (pCreateInfo->oldSwapchain) {
+            if (auto oldOverlay = HdrOverlay::get(pCreateInfo->oldSwapchain)) {
+                oldOverlay->retired = true;
+            }
+        }
+        HdrOverlay::create(*pSwapchain, HdrOverlayData{
+            .overlay = std::move(overlay),
+        });
+        return VK_SUCCESS;
+    }
 };
 }
 
@@ -824,3 +2675,7 @@ VKROOTS_DEFINE_LAYER_INTERFACES(HdrLayer::VkInstanceOverrides,
 
 VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrSurface);
 VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrSwapchain);
+VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrInstance);
+VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrQueue);
+VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrDevice);
+VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrOverlay);
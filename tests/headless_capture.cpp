@@ -0,0 +1,297 @@
+// Presents one cleared HDR10 frame to a headless surface through the loader
+// with the layer enabled, then checks the capture it wrote. Meant for lavapipe
+// in CI; exits with 77, which meson reports as skipped, without a Vulkan driver.
+#include <vulkan/vulkan.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static constexpr int SkipExitCode = 77;
+static constexpr VkExtent2D Extent = { 64, 64 };
+// 0x3ff in each color channel of A2B10G10R10, opaque alpha
+static constexpr uint32_t ClearedPixel = 0xffffffff;
+
+static bool ReadFile(const std::string &path, std::string &contents)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        contents.append(buffer, size);
+    }
+    fclose(file);
+    return true;
+}
+
+#define CHECK(condition)                                                          \
+    do {                                                                          \
+        if (!(condition)) {                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return 1;                                                             \
+        }                                                                         \
+    } while (0)
+
+int main()
+{
+    const char *captureDir = getenv("HDR_WSI_CAPTURE_DIR");
+    CHECK(captureDir);
+    mkdir(captureDir, 0755);
+
+    const std::vector<const char *> instanceExtensions = {
+        VK_KHR_SURFACE_EXTENSION_NAME,
+        VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME,
+        VK_EXT_SWAPCHAIN_COLOR_SPACE_EXTENSION_NAME,
+    };
+    const char *layerName = "VK_LAYER_hdr_wsi";
+    const VkApplicationInfo appInfo = {
+        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        .apiVersion = VK_API_VERSION_1_1,
+    };
+    const VkInstanceCreateInfo instanceInfo = {
+        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pApplicationInfo = &appInfo,
+        .enabledLayerCount = 1,
+        .ppEnabledLayerNames = &layerName,
+        .enabledExtensionCount = uint32_t(instanceExtensions.size()),
+        .ppEnabledExtensionNames = instanceExtensions.data(),
+    };
+    VkInstance instance;
+    VkResult result = vkCreateInstance(&instanceInfo, nullptr, &instance);
+    if (result == VK_ERROR_INCOMPATIBLE_DRIVER || result == VK_ERROR_EXTENSION_NOT_PRESENT) {
+        fprintf(stderr, "No Vulkan driver with headless surfaces, skipping\n");
+        return SkipExitCode;
+    }
+    CHECK(result == VK_SUCCESS);
+
+    // lavapipe is a CPU device, prefer it over whatever else is around
+    uint32_t count = 0;
+    vkEnumeratePhysicalDevices(instance, &count, nullptr);
+    std::vector<VkPhysicalDevice> physicalDevices(count);
+    vkEnumeratePhysicalDevices(instance, &count, physicalDevices.data());
+    if (physicalDevices.empty()) {
+        fprintf(stderr, "No Vulkan device, skipping\n");
+        return SkipExitCode;
+    }
+    VkPhysicalDevice physicalDevice = physicalDevices[0];
+    for (VkPhysicalDevice candidate : physicalDevices) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(candidate, &properties);
+        if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU) {
+            physicalDevice = candidate;
+        }
+    }
+
+    const VkHeadlessSurfaceCreateInfoEXT surfaceInfo = {
+        .sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT,
+    };
+    VkSurfaceKHR surface;
+    CHECK(vkCreateHeadlessSurfaceEXT(instance, &surfaceInfo, nullptr, &surface) == VK_SUCCESS);
+
+    // the layer offers HDR formats on headless surfaces even though Mesa's WSI doesn't
+    vkGetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &count, nullptr);
+    std::vector<VkSurfaceFormatKHR> formats(count);
+    vkGetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &count, formats.data());
+    bool hasHdr10 = false;
+    for (const auto &format : formats) {
+        hasHdr10 |= format.format == VK_FORMAT_A2B10G10R10_UNORM_PACK32 && format.colorSpace == VK_COLOR_SPACE_HDR10_ST2084_EXT;
+    }
+    CHECK(hasHdr10);
+
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &count, nullptr);
+    std::vector<VkQueueFamilyProperties> families(count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &count, families.data());
+    uint32_t queueFamily = UINT32_MAX;
+    for (uint32_t i = 0; i < count; i++) {
+        VkBool32 supported = VK_FALSE;
+        vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, i, surface, &supported);
+        if (supported && (families[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_TRANSFER_BIT))) {
+            queueFamily = i;
+            break;
+        }
+    }
+    CHECK(queueFamily != UINT32_MAX);
+
+    const float priority = 1.0f;
+    const VkDeviceQueueCreateInfo queueInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = queueFamily,
+        .queueCount = 1,
+        .pQueuePriorities = &priority,
+    };
+    const std::vector<const char *> deviceExtensions = {
+        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+        VK_EXT_HDR_METADATA_EXTENSION_NAME,
+    };
+    const VkDeviceCreateInfo deviceInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .queueCreateInfoCount = 1,
+        .pQueueCreateInfos = &queueInfo,
+        .enabledExtensionCount = uint32_t(deviceExtensions.size()),
+        .ppEnabledExtensionNames = deviceExtensions.data(),
+    };
+    VkDevice device;
+    CHECK(vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device) == VK_SUCCESS);
+    VkQueue queue;
+    vkGetDeviceQueue(device, queueFamily, 0, &queue);
+
+    const auto pfnSetHdrMetadataEXT = reinterpret_cast<PFN_vkSetHdrMetadataEXT>(vkGetDeviceProcAddr(device, "vkSetHdrMetadataEXT"));
+    CHECK(pfnSetHdrMetadataEXT);
+
+    VkSurfaceCapabilitiesKHR capabilities;
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface, &capabilities);
+    CHECK(capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+    const VkSwapchainCreateInfoKHR swapchainInfo = {
+        .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+        .surface = surface,
+        .minImageCount = capabilities.minImageCount,
+        .imageFormat = VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+        .imageColorSpace = VK_COLOR_SPACE_HDR10_ST2084_EXT,
+        .imageExtent = Extent,
+        .imageArrayLayers = 1,
+        .imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+        .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+        .presentMode = VK_PRESENT_MODE_FIFO_KHR,
+        .clipped = VK_TRUE,
+    };
+    VkSwapchainKHR swapchain;
+    CHECK(vkCreateSwapchainKHR(device, &swapchainInfo, nullptr, &swapchain) == VK_SUCCESS);
+
+    const VkHdrMetadataEXT metadata = {
+        .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+        .displayPrimaryRed = { 0.708f, 0.292f },
+        .displayPrimaryGreen = { 0.170f, 0.797f },
+        .displayPrimaryBlue = { 0.131f, 0.046f },
+        .whitePoint = { 0.3127f, 0.3290f },
+        .maxLuminance = 1000.0f,
+        .minLuminance = 0.005f,
+        .maxContentLightLevel = 1000.0f,
+        .maxFrameAverageLightLevel = 400.0f,
+    };
+    pfnSetHdrMetadataEXT(device, 1, &swapchain, &metadata);
+
+    vkGetSwapchainImagesKHR(device, swapchain, &count, nullptr);
+    std::vector<VkImage> images(count);
+    vkGetSwapchainImagesKHR(device, swapchain, &count, images.data());
+
+    const VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+    VkSemaphore acquired, rendered;
+    CHECK(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &acquired) == VK_SUCCESS);
+    CHECK(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &rendered) == VK_SUCCESS);
+    uint32_t imageIndex;
+    CHECK(vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, acquired, VK_NULL_HANDLE, &imageIndex) == VK_SUCCESS);
+
+    const VkCommandPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .queueFamilyIndex = queueFamily,
+    };
+    VkCommandPool commandPool;
+    CHECK(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) == VK_SUCCESS);
+    const VkCommandBufferAllocateInfo allocateInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+    VkCommandBuffer commandBuffer;
+    CHECK(vkAllocateCommandBuffers(device, &allocateInfo, &commandBuffer) == VK_SUCCESS);
+
+    const VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    const VkImageSubresourceRange range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    const VkImageMemoryBarrier toClear = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = 0,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = images[imageIndex],
+        .subresourceRange = range,
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toClear);
+    const VkClearColorValue white = { .float32 = { 1.0f, 1.0f, 1.0f, 1.0f } };
+    vkCmdClearColorImage(commandBuffer, images[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &white, 1, &range);
+    // the layer's capture has to pick the write up from here
+    const VkImageMemoryBarrier toPresent = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = 0,
+        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = images[imageIndex],
+        .subresourceRange = range,
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &toPresent);
+    vkEndCommandBuffer(commandBuffer);
+
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    const VkSubmitInfo submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores = &acquired,
+        .pWaitDstStageMask = &waitStage,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &commandBuffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &rendered,
+    };
+    CHECK(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) == VK_SUCCESS);
+    const VkPresentInfoKHR presentInfo = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores = &rendered,
+        .swapchainCount = 1,
+        .pSwapchains = &swapchain,
+        .pImageIndices = &imageIndex,
+    };
+    CHECK(vkQueuePresentKHR(queue, &presentInfo) == VK_SUCCESS);
+    vkQueueWaitIdle(queue);
+
+    // waits for the capture worker to write the files
+    vkDestroySwapchainKHR(device, swapchain, nullptr);
+    vkDestroySemaphore(device, acquired, nullptr);
+    vkDestroySemaphore(device, rendered, nullptr);
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    vkDestroyDevice(device, nullptr);
+    vkDestroySurfaceKHR(instance, surface, nullptr);
+    vkDestroyInstance(instance, nullptr);
+
+    // the first swapchain in this process is capture ring 0, its first present frame 0
+    const std::string prefix = std::string(captureDir) + "/hdr_capture_" + std::to_string(getpid()) + "_0_000000";
+    std::string raw, json;
+    CHECK(ReadFile(prefix + ".raw", raw));
+    CHECK(ReadFile(prefix + ".json", json));
+    unlink((prefix + ".raw").c_str());
+    unlink((prefix + ".json").c_str());
+
+    CHECK(raw.size() == size_t(Extent.width) * Extent.height * sizeof(uint32_t));
+    for (size_t offset = 0; offset < raw.size(); offset += sizeof(uint32_t)) {
+        uint32_t pixel;
+        memcpy(&pixel, raw.data() + offset, sizeof(pixel));
+        CHECK(pixel == ClearedPixel);
+    }
+
+    CHECK(json.find("\"colorSpace\": \"VK_COLOR_SPACE_HDR10_ST2084_EXT\"") != std::string::npos);
+    CHECK(json.find("\"tagged\": true") != std::string::npos);
+    CHECK(json.find("\"maxLuminance\": 1000.000000") != std::string::npos);
+    return 0;
+}
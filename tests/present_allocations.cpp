@@ -0,0 +1,187 @@
+// Drives SetHdrMetadataEXT and QueuePresentKHR through a stub device dispatch
+// and fails if the steady-state present path allocates. A headless surface
+// writing to /dev/null keeps the compositor out of it while still formatting
+// every sink line; the layer source is built into the test so it can reach the
+// overrides and the per-object maps directly.
+#include "VkLayer_hdr_wsi.cpp"
+
+#include <new>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+static std::atomic<bool> s_counting = false;
+static std::atomic<uint64_t> s_allocations = 0;
+
+static void CountAllocation()
+{
+    if (s_counting.load(std::memory_order_relaxed)) {
+        s_allocations++;
+    }
+}
+
+extern "C" void *malloc(size_t size)
+{
+    CountAllocation();
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    CountAllocation();
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    CountAllocation();
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    CountAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *operator new(size_t size)
+{
+    CountAllocation();
+    if (void *ptr = __libc_malloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubQueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL StubGetDeviceProcAddr(VkDevice device, const char *pName)
+{
+    if (pName == "vkQueuePresentKHR"sv) {
+        return reinterpret_cast<PFN_vkVoidFunction>(StubQueuePresentKHR);
+    }
+    return nullptr;
+}
+
+template <typename T>
+static T FakeHandle(uintptr_t value)
+{
+    return (T)value;
+}
+
+int main()
+{
+    const auto device = FakeHandle<VkDevice>(0x10);
+    const auto queue = FakeHandle<VkQueue>(0x20);
+    const auto surface = FakeHandle<VkSurfaceKHR>(0x30);
+    const auto swapchain = FakeHandle<VkSwapchainKHR>(0x40);
+
+    const VkDeviceCreateInfo deviceInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+    };
+    const vkroots::VkDeviceDispatch dispatch(StubGetDeviceProcAddr, device, VK_NULL_HANDLE, nullptr, &deviceInfo);
+
+    HdrLayer::HdrSurface::create(surface, HdrLayer::HdrSurfaceData{
+        .probed = true,
+        .activated = true,
+        .headless = true,
+        .sinkFd = open("/dev/null", O_WRONLY | O_CLOEXEC),
+    });
+    HdrLayer::HdrSwapchain::create(swapchain, HdrLayer::HdrSwapchainData{
+        .surface = surface,
+        .format = VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+        .colorSpace = VK_COLOR_SPACE_HDR10_ST2084_EXT,
+        .description = HdrLayer::FindColorDescription(VK_COLOR_SPACE_HDR10_ST2084_EXT),
+        .prepared = std::vector<HdrLayer::PreparedDescription>(HdrLayer::s_ExtraHDRSurfaceFormats.size()),
+        .desc_dirty = true,
+    });
+
+    const VkHdrMetadataEXT metadata = {
+        .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+        .displayPrimaryRed = { 0.708f, 0.292f },
+        .displayPrimaryGreen = { 0.170f, 0.797f },
+        .displayPrimaryBlue = { 0.131f, 0.046f },
+        .whitePoint = { 0.3127f, 0.3290f },
+        .maxLuminance = 1000.0f,
+        .minLuminance = 0.005f,
+        .maxContentLightLevel = 1000.0f,
+        .maxFrameAverageLightLevel = 400.0f,
+    };
+
+    // Apps commonly resubmit the same metadata and color space every frame;
+    // that may not allocate. Retagging isn't covered: on Wayland it sends new
+    // requests, and libwayland allocates a closure for each of them.
+    const auto present = [&](uint32_t frame, VkColorSpaceKHR colorSpace) {
+        const VkPresentColorSpaceInfoHDRWSI colorSpaceInfo = {
+            .sType = VK_STRUCTURE_TYPE_PRESENT_COLOR_SPACE_INFO_HDRWSI,
+            .swapchainCount = 1,
+            .pColorSpaces = &colorSpace,
+        };
+        const uint32_t imageIndex = frame % 3;
+        const VkPresentInfoKHR presentInfo = {
+            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+            .pNext = &colorSpaceInfo,
+            .swapchainCount = 1,
+            .pSwapchains = &swapchain,
+            .pImageIndices = &imageIndex,
+        };
+        HdrLayer::VkDeviceOverrides::SetHdrMetadataEXT(&dispatch, device, 1, &swapchain, &metadata);
+        return HdrLayer::VkDeviceOverrides::QueuePresentKHR(&dispatch, queue, &presentInfo);
+    };
+
+    // the first presents send the initial tag, log the metadata and retag
+    // through sRGB and back, so the steady state starts from a retag
+    constexpr uint32_t warmupFrames = 10;
+    constexpr uint32_t steadyFrames = 1000;
+    for (uint32_t frame = 0; frame < warmupFrames; frame++) {
+        present(frame, frame == warmupFrames / 2 ? VK_COLOR_SPACE_SRGB_NONLINEAR_KHR : VK_COLOR_SPACE_HDR10_ST2084_EXT);
+    }
+
+    s_counting = true;
+    for (uint32_t frame = warmupFrames; frame < warmupFrames + steadyFrames; frame++) {
+        if (present(frame, VK_COLOR_SPACE_HDR10_ST2084_EXT) != VK_SUCCESS) {
+            s_counting = false;
+            fprintf(stderr, "QueuePresentKHR failed on frame %u\n", frame);
+            return 1;
+        }
+    }
+    s_counting = false;
+
+    if (s_allocations) {
+        fprintf(stderr, "%" PRIu64 " allocations in %u steady-state presents\n", s_allocations.load(), steadyFrames);
+        return 1;
+    }
+    return 0;
+}